@@ -0,0 +1,179 @@
+/*
+Chip-8 Interpreter/Emulator
+Copyright (C) 2016  Alex Kowald
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+// Microbenchmark harness for the interpreter's hot kernels, built with
+// `make bench`. Each benchmark runs the real shipped code path through the
+// Chip8Bench friend declaration so nothing is measured in effigy.
+#include <cstdio>
+#include <cstring>
+#include <cmath>
+#include <chrono>
+#include <algorithm>
+
+#include "chip8.h"
+
+static constexpr unsigned int BATCHES = 8;	// Timed batches per benchmark.
+static constexpr uint64_t OPS_PER_BATCH = 1000000;
+
+// Times func() BATCHES times after one untimed warmup pass and prints the
+// mean ns per operation with the standard deviation across batches.
+template<typename F>
+static void Measure(const char *name, uint64_t opsPerCall, F func)
+{
+	func(); // Warmup: fault in code and data, settle the clock.
+
+	double sum = 0.0;
+	double sumSquares = 0.0;
+	for(unsigned int batch=0; batch<BATCHES; batch++)
+	{
+		auto start = std::chrono::steady_clock::now();
+		func();
+		auto finish = std::chrono::steady_clock::now();
+
+		double ns = std::chrono::duration_cast<std::chrono::nanoseconds>(finish - start).count() / (double)opsPerCall;
+		sum += ns;
+		sumSquares += ns*ns;
+	}
+
+	double mean = sum / BATCHES;
+	double variance = std::max(0.0, sumSquares / BATCHES - mean*mean);
+
+	printf("%-36s %9.2f ns/op  +/- %.2f\n", name, mean, std::sqrt(variance));
+}
+
+struct Chip8Bench
+{
+	// Re-exported so main() can name the private quirk and resolution profiles.
+	typedef Chip8::QuirkOriginal QuirkOriginal;
+	typedef Chip8::QuirkSCHIP QuirkSCHIP;
+	typedef Chip8::ResLow ResLow;
+	typedef Chip8::ResHigh ResHigh;
+
+	// Fills the program space with opCode repeated, closing with a jump back
+	// to 0x200 so the stream can be executed indefinitely.
+	static void FillStream(Chip8 &chip8, uint16_t opCode)
+	{
+		chip8.Reset();
+		for(int address=Chip8::PROGRAM_SPACE; address<Chip8::MAX_MEMORY-2; address += 2)
+		{
+			chip8.memory[address] = opCode >> 8;
+			chip8.memory[address+1] = opCode & 0xFF;
+		}
+		chip8.memory[Chip8::MAX_MEMORY-2] = 0x12;
+		chip8.memory[Chip8::MAX_MEMORY-1] = 0x00;
+	}
+
+	static void BenchDecoder(Chip8 &chip8, const char *name, uint16_t opCode)
+	{
+		FillStream(chip8, opCode);
+
+		Measure(name, OPS_PER_BATCH, [&]()
+		{
+			for(uint64_t i=0; i<OPS_PER_BATCH; i++) chip8.ExecuteInstruction();
+		});
+	}
+
+	// Forward jump chain: every slot jumps to the next one, so the decoder is
+	// measured without tripping the backward-jump idle-loop detection.
+	static void BenchJumpChain(Chip8 &chip8)
+	{
+		chip8.Reset();
+		for(int address=Chip8::PROGRAM_SPACE; address<Chip8::MAX_MEMORY-2; address += 2)
+		{
+			uint16_t target = address+2;
+			chip8.memory[address] = 0x10|(target >> 8);
+			chip8.memory[address+1] = target & 0xFF;
+		}
+		chip8.memory[Chip8::MAX_MEMORY-2] = 0x12;
+		chip8.memory[Chip8::MAX_MEMORY-1] = 0x00;
+
+		Measure("decoder: 1nnn jump chain", OPS_PER_BATCH, [&]()
+		{
+			for(uint64_t i=0; i<OPS_PER_BATCH; i++) chip8.ExecuteInstruction();
+		});
+	}
+
+	template<typename Profile, typename Res>
+	static void BenchDraw(Chip8 &chip8, const char *name, uint8_t x, uint8_t y, uint8_t height)
+	{
+		chip8.Reset();
+		chip8.I = 0x300;
+		for(int i=0; i<32; i++) chip8.memory[0x300+i] = 0xA5;
+		chip8.V[0] = x;
+		chip8.V[1] = y;
+
+		uint16_t opCode = 0xD010|height;
+		Measure(name, OPS_PER_BATCH, [&]()
+		{
+			for(uint64_t i=0; i<OPS_PER_BATCH; i++) chip8.template Op_Draw<Profile, Res>(opCode);
+		});
+	}
+
+	template<typename Res>
+	static void BenchConvert(Chip8 &chip8, const char *name, uint64_t rows)
+	{
+		// Stands in for the locked texture region the render thread writes to.
+		static uint32_t dest[Chip8::HIRES_W*Chip8::HIRES_H];
+
+		chip8.Reset();
+		for(int y=0; y<Res::H; y++)
+		{
+			for(int word=0; word<Res::WORDS; word++) chip8.display[y][word] = 0xA5A5A5A5A5A5A5A5ULL;
+		}
+
+		int minRow, maxRow;
+		if(!Chip8::DirtySpan(rows, Res::H, minRow, maxRow)) return;
+
+		Measure(name, OPS_PER_BATCH/100, [&]()
+		{
+			for(uint64_t i=0; i<OPS_PER_BATCH/100; i++) chip8.template ConvertDisplay<Res>(chip8.display, minRow, maxRow, dest, Res::W);
+		});
+	}
+};
+
+int main(int argc, char **argv)
+{
+	Chip8 chip8;
+	chip8.SetIPS(0);
+
+	printf("%u batches of %llu ops each, after warmup.\n\n", BATCHES, (unsigned long long)OPS_PER_BATCH);
+
+	// Decoder over synthetic single-opcode streams, one per family of interest.
+	Chip8Bench::BenchDecoder(chip8, "decoder: 6xkk load byte", 0x6055);
+	Chip8Bench::BenchDecoder(chip8, "decoder: 8xy4 add reg", 0x8124);
+	Chip8Bench::BenchDecoder(chip8, "decoder: 3xkk skip (not taken)", 0x30FF);
+	Chip8Bench::BenchDecoder(chip8, "decoder: Annn load I", 0xA300);
+	Chip8Bench::BenchDecoder(chip8, "decoder: Cxkk random", 0xC2FF);
+	Chip8Bench::BenchJumpChain(chip8);
+	printf("\n");
+
+	// Dxyn blit at varying heights and horizontal alignments.
+	Chip8Bench::BenchDraw<Chip8Bench::QuirkOriginal, Chip8Bench::ResLow>(chip8, "draw: 1 row, aligned", 0, 4, 1);
+	Chip8Bench::BenchDraw<Chip8Bench::QuirkOriginal, Chip8Bench::ResLow>(chip8, "draw: 5 rows, aligned", 0, 4, 5);
+	Chip8Bench::BenchDraw<Chip8Bench::QuirkOriginal, Chip8Bench::ResLow>(chip8, "draw: 5 rows, misaligned", 5, 4, 5);
+	Chip8Bench::BenchDraw<Chip8Bench::QuirkOriginal, Chip8Bench::ResLow>(chip8, "draw: 15 rows, misaligned", 5, 4, 15);
+	Chip8Bench::BenchDraw<Chip8Bench::QuirkOriginal, Chip8Bench::ResLow>(chip8, "draw: 15 rows, wrapping", 60, 28, 15);
+	Chip8Bench::BenchDraw<Chip8Bench::QuirkSCHIP, Chip8Bench::ResHigh>(chip8, "draw: 16x16 wide, misaligned", 5, 4, 0);
+	printf("\n");
+
+	// The render thread's palette expansion into the RGBA pixel buffer.
+	Chip8Bench::BenchConvert<Chip8Bench::ResLow>(chip8, "convert: full frame (32 rows)", ~0ull >> 32);
+	Chip8Bench::BenchConvert<Chip8Bench::ResLow>(chip8, "convert: single dirty row", 1ull << 12);
+	Chip8Bench::BenchConvert<Chip8Bench::ResHigh>(chip8, "convert: full hi-res frame (64 rows)", ~0ull);
+
+	return 0;
+}
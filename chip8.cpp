@@ -19,12 +19,16 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include <cstring>
 #include <climits>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include <cstdio>
 #include <fstream>
 #include <iostream>
+#include <sstream>
 #include <chrono>
+#include <thread>
 #include <algorithm>
-#include <unordered_map>
 #include <SDL.h>
 
 #include "chip8.h"
@@ -40,12 +44,84 @@ enum
 	DebugState_Run,
 };
 
+#ifdef CHIP8_PROFILE
+// Cheap per-instruction timestamp. Uses the TSC directly on x86 and falls
+// back to the steady clock in nanoseconds elsewhere.
+static inline uint64_t ReadTSC()
+{
+#if defined(__x86_64__) || defined(__i386__)
+	unsigned int lo, hi;
+	__asm__ __volatile__("rdtsc" : "=a"(lo), "=d"(hi));
+	return ((uint64_t)hi << 32)|lo;
+#else
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+}
+#endif
+
+// Wait until the target timestamp: a coarse sleep covers the bulk of the
+// wait and the final millisecond is spun, so frames land within tens of
+// microseconds of their slot instead of SDL_Delay's scheduler-quantum jitter.
+static void WaitUntil(const std::chrono::high_resolution_clock::time_point &target)
+{
+	auto now = std::chrono::high_resolution_clock::now();
+	auto spinMargin = std::chrono::milliseconds(1);
+
+	if(target - now > spinMargin)
+	{
+		std::this_thread::sleep_until(target - spinMargin);
+	}
+
+	while(std::chrono::high_resolution_clock::now() < target) {}
+}
+
+// Rotate right with the shift amount masked, so a rotate by 0 or 64 is safe.
+static inline uint64_t RotateRight64(uint64_t value, unsigned int amount)
+{
+	amount &= 63;
+	if(amount == 0) return value;
+
+	return (value >> amount)|(value << (64-amount));
+}
+
+// Rotate a 128-bit value held as two words (w0 most significant) right, for
+// sprite wrap on the 128-pixel hi-res rows.
+static inline void RotateRight128(uint64_t &w0, uint64_t &w1, unsigned int amount)
+{
+	amount &= 127;
+	if(amount >= 64)
+	{
+		uint64_t swap = w0;
+		w0 = w1;
+		w1 = swap;
+		amount -= 64;
+	}
+	if(amount == 0) return;
+
+	uint64_t r0 = (w0 >> amount)|(w1 << (64-amount));
+	uint64_t r1 = (w1 >> amount)|(w0 << (64-amount));
+	w0 = r0;
+	w1 = r1;
+}
+
+// Out-of-class definition: std::min in DumpTrace() binds a reference to the
+// constant, which odr-uses it, so C++11 still needs a definition to link.
+constexpr uint32_t Chip8::TRACE_BUFFER_SIZE;
+
 Chip8::Chip8()
 {
 	texture = nullptr;
 	renderer = nullptr;
 	window = nullptr;
+	sdlStarted = false;
+	init = false; // Set once Run() has its window; gates the lazy audio open in headless runs.
 	audioDevice = 0;
+	quirkMode = Quirk_Original;
+	hires = false;
+	SelectTables();
+	audioState.store(0);
+	audioFrequency = 400; // Hz.
+	audioSampleRate = 44100;
 
 	static const uint8_t fonts[16 * 5] = {
 		0xF0, 0x90, 0x90, 0x90, 0xF0, // 0
@@ -67,33 +143,90 @@ Chip8::Chip8()
 	};
 	std::memcpy(&font, &fonts, sizeof(fonts));
 
-	rng.seed(std::random_device()());
+#ifdef CHIP8_MT_RND
+	rng.seed((unsigned int)std::chrono::high_resolution_clock::now().time_since_epoch().count());
+#endif
+
+	// Seed from the clock rather than std::random_device: plenty for game
+	// RND, and it skips opening /dev/urandom on every launch.
+	rngState = (uint32_t)std::chrono::high_resolution_clock::now().time_since_epoch().count();
+	if(rngState == 0) rngState = 1; // xorshift32 must never hold a zero state.
+	rngCache = 0;
+	rngCacheBytes = 0;
 
-	pixels = new uint32_t[W*H]();
 	background = 0x000000; // Black.
 	foreground = 0xFFFFFF; // White.
+	RebuildPalette(background, foreground);
 
 	debug = false;
+	std::memset(breakpoints, 0, sizeof(breakpoints));
+	std::memset(watchpoints, 0, sizeof(watchpoints));
+	watchActive = false;
+	serverMode = false;
+	serverPaused = false;
+	serverQuit = false;
 	ips = 3000; // Instructions per second.
 	pixelScale = 16;
+	vsync = false;
+	quickSlotUsed = false;
+	idleSkipEnabled = true;
+
+	libraryMap = nullptr;
+	libraryMapSize = 0;
+	libraryEntries = nullptr;
+	libraryCount = 0;
+	libraryIndex = 0;
+
+	traceBuffer = nullptr;
+	traceIndex = 0;
+	traceCycle = 0;
+	traceEnabled = false;
+
+	checkpointInterval = 0;
+	checkpointOut = nullptr;
+	timeStartup = false;
+	audioTried = false;
+
+	replayClock = 0;
+	replayRecording = false;
+	replaySeed = 0;
+	replayActive = false;
+	replayInputIndex = 0;
+
+	framePublish.store(1); // Back buffer 0, middle 1, render front 2.
+	frameBack = 0;
+	frameCarryDirty = 0;
+	renderActive.store(false);
+	renderState.store(0);
+
+#ifdef CHIP8_PROFILE
+	ResetProfile();
+#endif
 
 	Reset();
 
-	if(SDL_Init(SDL_INIT_VIDEO|SDL_INIT_EVENTS|SDL_INIT_AUDIO) != 0)
-	{
-		printf("SDL_Init error: %s\n", SDL_GetError());
-	}
-
 	// Ensure we stay out of program space. (0x200 onwards)
 	SANITY_CHECK(PROGRAM_SPACE - ((uint8_t *)&keys + sizeof(keys) - (uint8_t *)&memory) >= 0, "No free program space");
 }
 
 Chip8::~Chip8()
 {
-	delete pixels;
+	delete[] traceBuffer;
+
+	if(checkpointOut != nullptr)
+	{
+		fclose(checkpointOut);
+		checkpointOut = nullptr;
+	}
+
+	if(libraryMap != nullptr)
+	{
+		munmap((void *)libraryMap, libraryMapSize);
+		libraryMap = nullptr;
+	}
 
 	CleanupSDL();
-	SDL_Quit();
+	if(sdlStarted) SDL_Quit();
 }
 
 void Chip8::Reset()
@@ -105,25 +238,71 @@ void Chip8::Reset()
 	I = 0x0000;
 	delayTimer = 0x00;
 	soundTimer = 0x00;
+	PublishAudioState();
 	keys = 0x00;
 	waitingKey = 0x00;
+	pendingPressed = 0;
+	pendingReleased = 0;
+	deferredRelease = 0;
+
+	// Drop any buffered random bytes so a fresh program always draws from
+	// rngState directly; replay depends on this being reproducible.
+	rngCache = 0;
+	rngCacheBytes = 0;
 
 	halt = false;
+	haltReason.clear();
+	cyclesExecuted = 0;
+	headlessClock = 0;
+	headlessNextTick = 0;
 	debugState = DebugState_StepInto;
 
+	idleSkip = false;
+	idleLoopHead = 0;
+	idleLoopHits = 0;
+
+	hires = false;
+	SelectTables();
+
+	FlushDecodeCache();
 	ClearScreen();
 }
 
+// Precompute the 8-pixel RGBA run for every possible display byte so
+// the render thread can expand a whole byte with one table lookup and a copy.
+void Chip8::RebuildPalette(uint32_t bg, uint32_t fg)
+{
+	for(int value=0; value<256; value++)
+	{
+		for(int bit=0; bit<8; bit++)
+		{
+			palette[value][bit] = (value >> (7-bit)) & 0x1 ? fg : bg;
+		}
+	}
+
+	paletteBackground = bg;
+	paletteForeground = fg;
+}
+
+// The setters only record the colors; the palette itself is rebuilt on the
+// render thread when a frame carrying the new pair is consumed.
 void Chip8::SetBackgroundColor(uint32_t color)
 {
 	color = std::min(color, 0xFFFFFFu);
 	background = color;
+
+	// Every row has to be reconverted with the new palette.
+	screenUpdated = true;
+	dirtyRows = ~0ull;
 }
 
 void Chip8::SetForegroundColor(uint32_t color)
 {
 	color = std::min(color, 0xFFFFFFu);
 	foreground = color;
+
+	screenUpdated = true;
+	dirtyRows = ~0ull;
 };
 
 void Chip8::AudioCallback(void *userdata, uint8_t *stream, int len)
@@ -131,19 +310,39 @@ void Chip8::AudioCallback(void *userdata, uint8_t *stream, int len)
 	static_cast<Chip8 *>(userdata)->SawtoothWave(stream, len);
 }
 
+// Publish the current sound state for the audio thread. Call after every
+// write to soundTimer; the release store pairs with the acquire load in
+// SawtoothWave() so the callback never touches the machine state.
+void Chip8::PublishAudioState()
+{
+	// First arm of the sound timer in a windowed session opens the audio
+	// device; until then launches pay nothing for audio.
+	if(!audioTried && init && soundTimer != 0) InitAudio();
+
+	audioState.store((uint32_t)soundTimer | ((uint32_t)audioFrequency << 16), std::memory_order_release);
+}
+
 void Chip8::SawtoothWave(uint8_t *stream, int len)
 {
 	//printf("SawtoothWave callback: len = %d, tick = %d\n", len/2, SDL_GetTicks());
-	
+
 	len /= 2;
 	Sint16 *buffer = (Sint16 *)stream;
 
-	if(soundTimer == 0)
+	// Runs on the SDL audio thread: consume the emulation thread's snapshot
+	// wait-free instead of reading soundTimer across threads.
+	uint32_t state = audioState.load(std::memory_order_acquire);
+	uint32_t ticks = state & 0xFFFF;
+	int frequency = state >> 16;
+
+	if(ticks == 0 || frequency == 0)
 	{
 		for(int i=0; i<len; i++) buffer[i] = 0;
 		return;
 	}
 
+	audioStep = 2.0 / (1.0 * audioSampleRate / frequency);
+
 	for(int i=0; i<len; i++)
 	{
 		double step = audioLevel + audioStep;
@@ -158,16 +357,11 @@ void Chip8::CleanupSDL()
 {
 	init = false;
 
-	if(texture != nullptr)
-	{
-		SDL_DestroyTexture(texture);
-		texture = nullptr;
-	}
-	if(renderer != nullptr)
-	{
-		SDL_DestroyRenderer(renderer);
-		renderer = nullptr;
-	}
+	// Stop the render thread first; it destroys the renderer and texture it
+	// owns on the way out.
+	renderActive.store(false, std::memory_order_release);
+	if(renderThread.joinable()) renderThread.join();
+
 	if(window != nullptr)
 	{
 		SDL_DestroyWindow(window);
@@ -179,19 +373,21 @@ void Chip8::CleanupSDL()
 		SDL_CloseAudioDevice(audioDevice);
 		audioDevice = 0;
 	}
+	audioTried = false; // The next windowed session opens audio lazily again.
 }
 
 bool Chip8::InitSDL()
 {
 	CleanupSDL();
 
-	// Check to see if the call to SDL_Init() was successful.
-	int mask = SDL_INIT_VIDEO|SDL_INIT_EVENTS|SDL_INIT_AUDIO;
-	if(SDL_WasInit(mask) != mask)
+	// SDL comes up here rather than in the constructor, so headless and batch
+	// instances (which may live on worker threads) never touch it at all.
+	if(SDL_Init(SDL_INIT_VIDEO|SDL_INIT_EVENTS|SDL_INIT_AUDIO) != 0)
 	{
-		printf("SDL is not initialized.\n");
+		printf("SDL_Init error: %s\n", SDL_GetError());
 		return false;
 	}
+	sdlStarted = true;
 
 	// Initialize graphics.
 	window = SDL_CreateWindow("CHIP-8", SDL_WINDOWPOS_CENTERED, SDL_WINDOWPOS_CENTERED, W*pixelScale, H*pixelScale, SDL_WINDOW_SHOWN);
@@ -201,21 +397,18 @@ bool Chip8::InitSDL()
 		return false;
 	}
 
-	renderer = SDL_CreateRenderer(window, -1, SDL_RENDERER_ACCELERATED);
-	if(renderer == nullptr)
-	{
-		printf("SDL_CreateRenderer error: %s\n", SDL_GetError());
-		return false;
-	}
+	// The renderer and texture are created by the render thread so they are
+	// owned by the thread that uses them. See RenderThreadMain(). Audio
+	// device setup is deferred until the first nonzero soundTimer; see
+	// InitAudio().
 
-	texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_RGB888, SDL_TEXTUREACCESS_STREAMING, W, H);
-	if(texture == nullptr)
-	{
-		printf("SDL_CreateTexture error: %s\n", SDL_GetError());
-		return false;
-	}
+	return true;
+}
+
+void Chip8::InitAudio()
+{
+	audioTried = true;
 
-	// Initialize audio components.
 	SDL_AudioSpec want, have;
 	want.freq = 44100;
 	want.format = AUDIO_S16SYS;
@@ -234,24 +427,28 @@ bool Chip8::InitSDL()
 	}else{
 		printf("Using audio driver: '%s'\n", SDL_GetCurrentAudioDriver());
 		//printf(" frequency: %d format: f %d s %d be %d sz %d channels: %d samples: %d\n", have.freq, SDL_AUDIO_ISFLOAT(have.format), SDL_AUDIO_ISSIGNED(have.format), SDL_AUDIO_ISBIGENDIAN(have.format), SDL_AUDIO_BITSIZE(have.format), have.channels, have.samples);
-		
-		int frequency = 400; // Hz.
-		audioStep = 2.0 / (1.0 * have.freq / frequency);
+
+		audioSampleRate = have.freq;
 		SetVolume(0.1f);
 		audioLevel = 0.0;
+		PublishAudioState();
 
 		SDL_PauseAudioDevice(audioDevice, 0);
 	}
-
-	return true;
 }
 
 void Chip8::ShowAudioDevices()
 {
+	// Bring up just the audio subsystem on demand; listing devices must work
+	// before (or without) a window.
 	if(SDL_WasInit(SDL_INIT_AUDIO) == 0)
 	{
-		printf("Failed to retrieve audio devices: Audio subsystem is not initialized!\n");
-		return;
+		if(SDL_InitSubSystem(SDL_INIT_AUDIO) != 0)
+		{
+			printf("Failed to retrieve audio devices: %s\n", SDL_GetError());
+			return;
+		}
+		sdlStarted = true;
 	}
 
 	printf("====================================================\n");
@@ -305,6 +502,10 @@ bool Chip8::LoadProgram(const std::string &fileName)
 		return false;
 	}
 
+	// Clear program space first so a shorter program never executes leftovers
+	// from a previously loaded one when the instance is reused.
+	std::memset(&memory[PROGRAM_SPACE], 0, MAX_PROGRAM_SIZE);
+
 	input.read((char *)&memory[PROGRAM_SPACE], MAX_PROGRAM_SIZE);
 	printf("Loaded program.. %s (%ld bytes)\n", fileName.c_str(), (long int)input.gcount());
 
@@ -313,251 +514,1999 @@ bool Chip8::LoadProgram(const std::string &fileName)
 	return true;
 }
 
-void Chip8::SetKey(uint8_t key, bool pressed)
+#ifdef CHIP8_PROFILE
+void Chip8::ResetProfile()
 {
-	if(pressed)
-	{
-		keys |= (1 << key);
-	}else{
-		keys &= ~(1 << key);
-	}
+	std::memset(profileFamilyCount, 0, sizeof(profileFamilyCount));
+	std::memset(profileFamilyTicks, 0, sizeof(profileFamilyTicks));
+	std::memset(profileAddressCount, 0, sizeof(profileAddressCount));
 }
 
-void Chip8::ClearScreen()
+void Chip8::DumpProfile()
 {
-	display.reset();
-	screenUpdated = true;
-}
+	static const char *families[16] = {
+		"0nnn", "1nnn", "2nnn", "3xkk", "4xkk", "5xy0", "6xkk", "7xkk",
+		"8xyz", "9xy0", "Annn", "Bnnn", "Cxkk", "Dxyn", "Exkk", "Fxkk",
+	};
 
-void Chip8::DrawScreen()
-{
-	if(!init) return;
-	if(!screenUpdated) return; // Don't draw the screen unless it has changed.
+	uint64_t total = 0;
+	for(int i=0; i<16; i++) total += profileFamilyCount[i];
 
-	for(int i=0; i<W*H; i++)
+	printf("====================================================\n");
+	printf("Profile: %llu instructions executed.\n", (unsigned long long)total);
+	printf("family\tcount\t\tticks\t\tticks/op\n");
+	for(int i=0; i<16; i++)
 	{
-		if(display[i])
-		{
-			pixels[i] = foreground;
-		}else{
-			pixels[i] = background;
-		}
-	}
+		if(profileFamilyCount[i] == 0) continue;
 
-	SDL_UpdateTexture(texture, NULL, pixels, W*sizeof(uint32_t));
+		printf("%s\t%-12llu\t%-12llu\t%.1f\n", families[i],
+			(unsigned long long)profileFamilyCount[i],
+			(unsigned long long)profileFamilyTicks[i],
+			1.0 * profileFamilyTicks[i] / profileFamilyCount[i]);
+	}
 
-	//SDL_RenderClear(renderer);
-	SDL_RenderCopy(renderer, texture, NULL, NULL);
-	SDL_RenderPresent(renderer);
+	// Show the hottest program addresses; a tight top cluster usually means
+	// the ROM is stuck in a busy-wait loop.
+	printf("Hot addresses:\n");
+	for(int rank=0; rank<10; rank++)
+	{
+		uint32_t best = 0;
+		int bestAddr = -1;
+		for(int addr=PROGRAM_SPACE; addr<MAX_MEMORY; addr++)
+		{
+			if(profileAddressCount[addr] > best)
+			{
+				best = profileAddressCount[addr];
+				bestAddr = addr;
+			}
+		}
+		if(bestAddr < 0) break;
 
-	screenUpdated = false;
+		printf(" 0x%04X\t%u (%.1f%%)\n", bestAddr, best, total ? 100.0 * best / total : 0.0);
+		profileAddressCount[bestAddr] = 0; // Consumed by the report.
+	}
+	printf("====================================================\n");
 }
+#endif
 
-void Chip8::Run()
+// FNV-1a over the display rows. Lets automated runs compare screen output
+// without a display server or screenshots.
+uint64_t Chip8::GetDisplayHash() const
 {
-	if(!InitSDL())
+	uint64_t hash = 14695981039346656037ULL;
+	for(int y=0; y<HIRES_H; y++)
 	{
-		CleanupSDL();
-
-		printf("Failed to run: SDL setup failed!\n");
-		return;
+		for(int word=0; word<ROW_WORDS; word++)
+		{
+			for(int byte=0; byte<8; byte++)
+			{
+				hash ^= (display[y][word] >> (byte*8)) & 0xFF;
+				hash *= 1099511628211ULL;
+			}
+		}
 	}
 
-	init = true; // Created the SDL window successfully!
+	return hash;
+}
 
-	unsigned int insPerFrame = std::max(1u, ips/FPS/2);
-	unsigned int consecutiveIns = 0;
-	unsigned int framesFinished = 0;
+void Chip8::GetDisplaySnapshot(uint64_t *buffer) const
+{
+	std::memcpy(buffer, display, sizeof(display));
+}
 
-	SDL_Event event;
-	bool running = true;
-	auto start = std::chrono::high_resolution_clock::now();
+// Prints the launch-to-first-instruction latency once, right before a run
+// loop starts executing.
+void Chip8::ReportStartup()
+{
+	if(!timeStartup) return;
+	timeStartup = false;
 
-	printf("Running program at: %u IPS.. (%u)\n", ips, insPerFrame);
+	std::chrono::duration<double, std::milli> elapsed = std::chrono::high_resolution_clock::now() - startupLaunch;
+	printf("Startup: %.2f ms from launch to first instruction.\n", elapsed.count());
+}
 
-	static std::unordered_map<int, int> keymap = {
-		{SDL_SCANCODE_1, 0x1}, {SDL_SCANCODE_2, 0x2}, {SDL_SCANCODE_3, 0x3}, {SDL_SCANCODE_4, 0xC},
-		{SDL_SCANCODE_Q, 0x4}, {SDL_SCANCODE_W, 0x5}, {SDL_SCANCODE_E, 0x6}, {SDL_SCANCODE_R, 0xD},
-		{SDL_SCANCODE_A, 0x7}, {SDL_SCANCODE_S, 0x8}, {SDL_SCANCODE_D, 0x9}, {SDL_SCANCODE_F, 0xE},
-		{SDL_SCANCODE_Z, 0xA}, {SDL_SCANCODE_X, 0x0}, {SDL_SCANCODE_C, 0xB}, {SDL_SCANCODE_V, 0xF},
-	};
+bool Chip8::SetCheckpointFile(const std::string &fileName)
+{
+	if(checkpointOut != nullptr) fclose(checkpointOut);
 
-	while(running && !halt)
+	checkpointOut = fopen(fileName.c_str(), "w");
+	if(checkpointOut == nullptr)
 	{
-		// Execute CPU for consecutiveIns OR until the CPU is waiting for a key to be pressed.
-		for(unsigned int i=0; i<consecutiveIns && !(waitingKey & WAITINGKEY_FLAG); i++)
-		{
-			ExecuteInstruction();
-		}
-		// Handle window events.
-		while(SDL_PollEvent(&event))
-		{
-			switch(event.type)
-			{
-				case SDL_QUIT:
-					running = false;
-					break;
-				case SDL_KEYUP:
-				case SDL_KEYDOWN:
-					auto key = keymap.find(event.key.keysym.scancode);
-					if(key == keymap.end()) break;
-
-					uint16_t flag = (1 << (key->second & 0xF));
-					if(event.type == SDL_KEYDOWN)
-					{
-						keys |= flag;
-					}else{
-						keys &= ~flag;
-					}
+		printf("Failed to open checkpoint file: %s\n", fileName.c_str());
+		return false;
+	}
 
-					if(event.type == SDL_KEYDOWN && waitingKey & WAITINGKEY_FLAG)
-					{
-						V[waitingKey & 0xF] = key->second & 0xF;
-						waitingKey = 0;
-					}
-			}
-		}
-		
-		std::chrono::duration<double> elapsedSeconds = std::chrono::high_resolution_clock::now() - start;
-		int frames = int(elapsedSeconds.count() * FPS) - framesFinished;
-		if(frames > 0)
-		{
-			framesFinished += frames;
-			// Timer registers decrement at a rate of 60 Hz.
-			delayTimer -= std::min(frames, int(delayTimer));
-			soundTimer -= std::min(frames, int(soundTimer));
+	return true;
+}
 
-			DrawScreen();
-		}
+void Chip8::SaveState(SaveStateData &state) const
+{
+	state.magic = SAVESTATE_MAGIC;
+	state.version = SAVESTATE_VERSION;
+	std::memcpy(state.memory, memory, sizeof(state.memory));
+	std::memcpy(state.display, display, sizeof(display));
+	state.rngState = rngState;
+	state.rngCache = rngCache;
+	state.rngCacheBytes = rngCacheBytes;
+	state.halt = halt;
+	state.hires = hires ? 1 : 0;
+}
 
-		consecutiveIns = std::max(1, frames) * insPerFrame;
-		if(waitingKey & WAITINGKEY_FLAG || !frames) SDL_Delay(1000/FPS);
+bool Chip8::LoadState(const SaveStateData &state)
+{
+	if(state.magic != SAVESTATE_MAGIC || state.version != SAVESTATE_VERSION)
+	{
+		printf("Failed to load state.. Unrecognized savestate format.\n");
+		return false;
 	}
 
-	printf("Program terminated.\n");
+	std::memcpy(memory, state.memory, sizeof(state.memory));
+	std::memcpy(display, state.display, sizeof(display));
+	rngState = state.rngState;
+	rngCache = state.rngCache;
+	rngCacheBytes = state.rngCacheBytes;
+	halt = state.halt;
+	hires = state.hires != 0;
+	SelectTables();
 
-	CleanupSDL(); // Finished running so destroy the window. SDL still remains initialized until the object is destroyed.
-}
+	// The restored program memory may differ from what has been predecoded.
+	FlushDecodeCache();
 
-void Chip8::DumpRegisters()
-{
-	printf("Register dump:\n\t  0   1   2   3   4   5   6   7   8   9   A   B   C   D   E   F\nV[]\t= ");
-	for(int i=0; i<MAX_REGISTERS; i++) printf("%03X ", V[i]);
-	printf("\nS[]\t= ");
-	for(int i=0; i<MAX_REGISTERS; i++) printf("%03X ", stack[i]);
+	// The restored display has to be fully reconverted, and the audio thread
+	// has to see the restored sound timer.
+	screenUpdated = true;
+	dirtyRows = ~0ull;
+	PublishAudioState();
 
-	printf("\nSP\t= 0x%X\nI\t= 0x%X\nPC\t= 0x%X\nDT\t= 0x%X\nST\t= 0x%X\n", SP, I, PC, delayTimer, soundTimer);
+	return true;
 }
 
-void Chip8::DumpDisplay()
+bool Chip8::SaveStateToFile(const std::string &fileName) const
 {
-	printf("Display dump:");
+	SaveStateData state;
+	SaveState(state);
 
-	for(int i=0; i<W*H; i++)
+	std::ofstream output(fileName.c_str(), std::ios::out|std::ios::binary|std::ios::trunc);
+	if(!output.is_open())
 	{
-		if(i % W == 0)
-		{
-			printf("\n%2d: ", (i/W)+1);
-		}
-
-		if(display[i])
-			printf("X "); // Pixel set.
-		else
-			printf("- "); // Pixel unset.
+		printf("Failed to save state.. Failed to open file: %s\n", fileName.c_str());
+		return false;
 	}
-	printf("\n");
+
+	output.write((const char *)&state, sizeof(state));
+	printf("Saved state.. %s\n", fileName.c_str());
+
+	return true;
 }
 
-void Chip8::Halt(const char *reason)
+bool Chip8::LoadStateFromFile(const std::string &fileName)
 {
-	halt = true;
+	SaveStateData state;
 
-	printf("Program halted: %s\n", reason);
+	std::ifstream input(fileName.c_str(), std::ios::in|std::ios::binary);
+	if(!input.is_open())
+	{
+		printf("Failed to load state.. Failed to open file: %s\n", fileName.c_str());
+		return false;
+	}
 
-	if(debug)
+	input.read((char *)&state, sizeof(state));
+	if(input.gcount() != sizeof(state))
 	{
-		DumpRegisters();
+		printf("Failed to load state.. Truncated savestate file: %s\n", fileName.c_str());
+		return false;
 	}
+
+	if(!LoadState(state)) return false;
+
+	printf("Loaded state.. %s\n", fileName.c_str());
+
+	return true;
 }
 
-void PrintDebugHelp()
+// Start recording executed instructions into the ring buffer. The buffer is
+// allocated once here so capture itself never touches the heap. The trace is
+// written to fileName when the program halts or on the F4 hotkey.
+void Chip8::EnableTrace(const std::string &fileName)
 {
-	printf("Debug mode is enabled. Use the following commands to execute the program:\n h - display this message\n n - continue to next instruction\n r - show all register values\n c - continue until interrupted\n d - show display state\n q - Stop debugger\n");
+	if(traceBuffer == nullptr) traceBuffer = new TraceRecord[TRACE_BUFFER_SIZE];
+
+	traceEnabled = true;
+	traceFile = fileName;
+	traceIndex = 0;
+	traceCycle = 0;
 }
 
-// Return true to execute the next instruction, false otherwise.
-bool Chip8::DebuggerHandler()
+bool Chip8::DumpTrace(const std::string &fileName) const
 {
-	// Crude implementation of a debugger.
-	if(debugState == DebugState_Run) return true;
+	if(traceBuffer == nullptr) return false;
 
-	static bool once = false;
-	if(!once)
+	std::ofstream output(fileName.c_str(), std::ios::out|std::ios::binary|std::ios::trunc);
+	if(!output.is_open())
 	{
-		once = true;
-		PrintDebugHelp();
+		printf("Failed to dump trace.. Failed to open file: %s\n", fileName.c_str());
+		return false;
 	}
 
-	std::string command;
-	while(true)
+	TraceHeader header;
+	header.magic = TRACE_MAGIC;
+	header.version = TRACE_VERSION;
+	header.count = std::min(traceIndex, TRACE_BUFFER_SIZE);
+
+	output.write((const char *)&header, sizeof(header));
+
+	// Write oldest to newest so the reader can print straight through.
+	uint32_t start = traceIndex >= TRACE_BUFFER_SIZE ? traceIndex & (TRACE_BUFFER_SIZE-1) : 0;
+	for(uint32_t i=0; i<header.count; i++)
 	{
-		printf(":");
-		std::cin >> command;
-		char c = command.at(0);
-		if(c == 'h')
-		{
-			// Requested help.
-			PrintDebugHelp();
-		}else if(c == 'n')
-		{
-			// Execute the next instruction.
-			break;
-		}else if(c == 'r')
-		{
-			// Show the value of all registers.
-			DumpRegisters();
-		}else if(c == 'c')
-		{
-			// Continue executing instructions until interrupted.
-			debugState = DebugState_Run;
-			break;
-		}else if(c == 'd')
-		{
-			// Show the display state.
-			DumpDisplay();
-		}else if(c == 'q')
-		{
-			halt = true;
-			return false;
-		}
+		output.write((const char *)&traceBuffer[(start+i) & (TRACE_BUFFER_SIZE-1)], sizeof(TraceRecord));
 	}
 
+	printf("Dumped trace.. %s (%u records)\n", fileName.c_str(), header.count);
+
 	return true;
 }
 
-void Chip8::ExecuteInstruction()
+// Start recording key transitions for this session; the log is written out
+// when Run() finishes. Call before loading the program.
+void Chip8::RecordReplay(const std::string &fileName)
 {
-	if(halt) return;
+	replayRecording = true;
+	replayFile = fileName;
+	replaySeed = rngState;
+	replayLog.clear();
+}
 
-	// Instructions should start on even addresses but not all CHIP-8 programs follow that convention.
-	if(!(PC >= PROGRAM_SPACE && PC < MAX_MEMORY))
+bool Chip8::DumpReplay() const
+{
+	std::ofstream output(replayFile.c_str(), std::ios::out|std::ios::binary|std::ios::trunc);
+	if(!output.is_open())
 	{
-		SANITY_CHECK(false, "PC set to invalid address");
-		return;
+		printf("Failed to dump replay.. Failed to open file: %s\n", replayFile.c_str());
+		return false;
 	}
 
-	if(debug)
-	{
-		if(!DebuggerHandler())
-		{
+	ReplayHeader header;
+	header.magic = REPLAY_MAGIC;
+	header.version = REPLAY_VERSION;
+	header.seed = replaySeed;
+	header.ips = ips;
+	header.count = replayLog.size();
+
+	output.write((const char *)&header, sizeof(header));
+	output.write((const char *)replayLog.data(), replayLog.size() * sizeof(ReplayRecord));
+
+	printf("Dumped replay.. %s (%u key transitions)\n", replayFile.c_str(), header.count);
+
+	return true;
+}
+
+// Replays a recorded session headless at full host speed: same seed, same
+// IPS, key transitions re-applied at the exact recorded cycles. Call after
+// loading the same program the session was recorded with.
+bool Chip8::PlayReplay(const std::string &fileName, uint64_t maxCycles)
+{
+	std::ifstream input(fileName.c_str(), std::ios::in|std::ios::binary);
+	if(!input.is_open())
+	{
+		printf("Failed to load replay.. Failed to open file: %s\n", fileName.c_str());
+		return false;
+	}
+
+	ReplayHeader header;
+	input.read((char *)&header, sizeof(header));
+	if(input.gcount() != sizeof(header) || header.magic != REPLAY_MAGIC || header.version != REPLAY_VERSION)
+	{
+		printf("Failed to load replay.. Unrecognized replay format: %s\n", fileName.c_str());
+		return false;
+	}
+
+	replayInput.resize(header.count);
+	input.read((char *)replayInput.data(), header.count * sizeof(ReplayRecord));
+	if(input.gcount() != (std::streamsize)(header.count * sizeof(ReplayRecord)))
+	{
+		printf("Failed to load replay.. Truncated replay file: %s\n", fileName.c_str());
+		return false;
+	}
+
+	// Restore the session's nondeterministic inputs: RNG state and IPS.
+	rngState = header.seed;
+	rngCache = 0;
+	rngCacheBytes = 0;
+	ips = header.ips;
+
+	replayActive = true;
+	replayInputIndex = 0;
+
+	Run(maxCycles);
+
+	replayActive = false;
+
+	printf("Replay finished: %llu cycles, display hash %016llX.\n",
+		(unsigned long long)cyclesExecuted, (unsigned long long)GetDisplayHash());
+
+	return true;
+}
+
+// Serve RND one byte at a time from a cached 32-bit xorshift draw. Build
+// with CHIP8_MT_RND to fall back to the mt19937 path for reproducibility
+// testing against older versions.
+uint8_t Chip8::RandomByte()
+{
+#ifdef CHIP8_MT_RND
+	return std::uniform_int_distribution<unsigned int>(0, 255)(rng);
+#else
+	if(rngCacheBytes == 0)
+	{
+		rngState ^= rngState << 13;
+		rngState ^= rngState >> 17;
+		rngState ^= rngState << 5;
+		rngCache = rngState;
+		rngCacheBytes = 4;
+	}
+
+	uint8_t value = rngCache & 0xFF;
+	rngCache >>= 8;
+	rngCacheBytes--;
+
+	return value;
+#endif
+}
+
+// Map a packed ROM library into memory and validate its index. The mapping
+// stays alive for the lifetime of the object.
+bool Chip8::LoadLibrary(const std::string &fileName)
+{
+	int fd = open(fileName.c_str(), O_RDONLY);
+	if(fd == -1)
+	{
+		printf("Failed to load library.. Missing or invalid file: %s\n", fileName.c_str());
+		return false;
+	}
+
+	struct stat status;
+	if(fstat(fd, &status) != 0 || status.st_size < (off_t)sizeof(LibraryHeader))
+	{
+		printf("Failed to load library.. File too small: %s\n", fileName.c_str());
+		close(fd);
+		return false;
+	}
+
+	void *map = mmap(nullptr, status.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd); // The mapping keeps its own reference.
+	if(map == MAP_FAILED)
+	{
+		printf("Failed to load library.. mmap failed: %s\n", fileName.c_str());
+		return false;
+	}
+
+	const LibraryHeader *header = (const LibraryHeader *)map;
+	size_t indexSize = sizeof(LibraryHeader) + (size_t)header->count * sizeof(LibraryEntry);
+	if(header->magic != LIBRARY_MAGIC || header->version != LIBRARY_VERSION ||
+		header->count == 0 || (off_t)indexSize > status.st_size)
+	{
+		printf("Failed to load library.. Unrecognized library format: %s\n", fileName.c_str());
+		munmap(map, status.st_size);
+		return false;
+	}
+
+	if(libraryMap != nullptr) munmap((void *)libraryMap, libraryMapSize);
+
+	libraryMap = (const uint8_t *)map;
+	libraryMapSize = status.st_size;
+	libraryEntries = (const LibraryEntry *)(libraryMap + sizeof(LibraryHeader));
+	libraryCount = header->count;
+	libraryIndex = 0;
+
+	printf("Loaded library.. %s (%u programs)\n", fileName.c_str(), libraryCount);
+
+	return true;
+}
+
+// Copy one program image out of the mapped library and reset. This is the
+// fast path for switching games: no filesystem I/O, just a small memcpy.
+bool Chip8::LoadProgramFromLibrary(uint32_t index)
+{
+	if(libraryMap == nullptr || index >= libraryCount)
+	{
+		printf("Failed to load program.. Invalid library index: %u\n", index);
+		return false;
+	}
+
+	const LibraryEntry &entry = libraryEntries[index];
+	if(entry.size == 0 || entry.size > MAX_PROGRAM_SIZE ||
+		(size_t)entry.offset + entry.size > libraryMapSize)
+	{
+		printf("Failed to load program.. Corrupt library entry: %u\n", index);
+		return false;
+	}
+
+	std::memset(&memory[PROGRAM_SPACE], 0, MAX_PROGRAM_SIZE);
+	std::memcpy(&memory[PROGRAM_SPACE], libraryMap + entry.offset, entry.size);
+	libraryIndex = index;
+
+	printf("Loaded program.. %.*s (%u bytes) [%u/%u]\n", (int)sizeof(entry.name), entry.name, entry.size, index+1, libraryCount);
+
+	Reset();
+
+	return true;
+}
+
+// Records a key edge. Edges are buffered and folded into the keys bitfield
+// at the next frame boundary by ApplyPendingKeys(), so the instruction batch
+// runs against a stable keys value for the whole frame. The last edge wins:
+// a press cancels a buffered release, so a release/re-press of a held key
+// inside one frame never turns into a phantom release.
+void Chip8::SetKey(uint8_t key, bool pressed)
+{
+	uint16_t flag = 1 << (key & 0xF);
+	if(pressed)
+	{
+		pendingPressed |= flag;
+		pendingReleased &= ~flag;
+	}else{
+		pendingReleased |= flag;
+	}
+}
+
+// Applies the buffered key edges. Called once per frame; a press and release
+// inside the same frame leaves the key pressed until the following boundary.
+void Chip8::ApplyPendingKeys()
+{
+	uint16_t pressed = pendingPressed;
+	uint16_t released = pendingReleased;
+	pendingPressed = 0;
+	pendingReleased = 0;
+
+	// Fold the edges into what the new keys value should be, then hand the
+	// resulting transitions to the same path replay playback uses.
+	uint16_t before = keys;
+	uint16_t after = (before & ~deferredRelease) | pressed;
+	after &= ~(released & ~pressed);
+	deferredRelease = released & pressed;
+
+	uint16_t down = after & ~before;
+	uint16_t up = before & ~after;
+	if(down == 0 && up == 0) return;
+
+	if(replayRecording)
+	{
+		ReplayRecord record;
+		record.cycle = (uint32_t)replayClock;
+		record.pad[0] = 0;
+		record.pad[1] = 0;
+		for(uint8_t key=0; key<16; key++)
+		{
+			uint16_t flag = 1 << key;
+			if(!((down|up) & flag)) continue;
+
+			record.key = key;
+			record.pressed = (down & flag) ? 1 : 0;
+			replayLog.push_back(record);
+		}
+	}
+
+	ApplyKeyTransitions(down, up);
+}
+
+void Chip8::ApplyKeyTransitions(uint16_t down, uint16_t up)
+{
+	keys |= down;
+	keys &= ~up;
+
+	// A blocked Fx0A resolves here too, so key waits land on frame
+	// boundaries instead of somewhere inside an instruction batch.
+	if((waitingKey & WAITINGKEY_FLAG) && down)
+	{
+		for(uint8_t key=0; key<16; key++)
+		{
+			if(down & (1 << key))
+			{
+				V[waitingKey & 0xF] = key;
+				waitingKey = 0;
+				break;
+			}
+		}
+	}
+}
+
+void Chip8::ClearScreen()
+{
+	std::memset(display, 0, sizeof(display));
+	screenUpdated = true;
+	dirtyRows = ~0ull;
+}
+
+// Hand the current display to the render thread. A 1KB copy and one
+// atomic exchange; the emulation loop never touches the renderer itself.
+void Chip8::PublishFrame()
+{
+	if(!screenUpdated) return; // Don't publish a frame unless it has changed.
+
+	Frame &frame = frameBuffers[frameBack];
+	std::memcpy(frame.rows, display, sizeof(display));
+	frame.dirty = dirtyRows | frameCarryDirty;
+	frame.background = background;
+	frame.foreground = foreground;
+	frame.hires = hires ? 1 : 0;
+
+	uint32_t previous = framePublish.exchange(frameBack | FRAME_FRESH, std::memory_order_release);
+	frameBack = previous & FRAME_INDEX_MASK;
+	// If the render thread never consumed the previous frame, its dirty rows
+	// still need converting; fold them into the next publish.
+	frameCarryDirty = (previous & FRAME_FRESH) ? frameBuffers[frameBack].dirty : 0;
+
+	screenUpdated = false;
+	dirtyRows = 0;
+}
+
+bool Chip8::DirtySpan(uint64_t dirty, int height, int &minRow, int &maxRow)
+{
+	minRow = -1;
+	maxRow = 0;
+	for(int y=0; y<height; y++)
+	{
+		if(!(dirty & (1ull << y))) continue;
+		if(minRow < 0) minRow = y;
+		maxRow = y;
+	}
+
+	return minRow >= 0;
+}
+
+template<typename Res>
+void Chip8::ConvertDisplay(const uint64_t (*rows)[ROW_WORDS], int first, int last, uint32_t *dest, int pitch)
+{
+	// Every row in the span is written: the destination is a freshly locked
+	// texture region whose previous contents are undefined.
+	for(int y=first; y<=last; y++)
+	{
+		uint32_t *out = dest + (y-first)*pitch;
+		for(int part=0; part<Res::W/8; part++)
+		{
+			uint8_t value = (rows[y][part/8] >> (56 - (part%8)*8)) & 0xFF;
+			std::memcpy(&out[part*8], palette[value], sizeof(palette[value]));
+		}
+	}
+}
+
+// Instantiated explicitly so the benchmark harness can link against both.
+template void Chip8::ConvertDisplay<Chip8::ResLow>(const uint64_t (*)[ROW_WORDS], int, int, uint32_t *, int);
+template void Chip8::ConvertDisplay<Chip8::ResHigh>(const uint64_t (*)[ROW_WORDS], int, int, uint32_t *, int);
+
+// Body of the dedicated render thread. Creates (and therefore owns) the SDL
+// renderer and texture, then presents at its own rate: GPU present latency is
+// paid here and never by the emulation loop.
+void Chip8::RenderThreadMain()
+{
+	uint32_t rendererFlags = SDL_RENDERER_ACCELERATED;
+	if(vsync) rendererFlags |= SDL_RENDERER_PRESENTVSYNC;
+
+	renderer = SDL_CreateRenderer(window, -1, rendererFlags);
+	if(renderer == nullptr)
+	{
+		printf("SDL_CreateRenderer error: %s\n", SDL_GetError());
+		renderState.store(-1);
+		return;
+	}
+
+	texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_RGB888, SDL_TEXTUREACCESS_STREAMING, W, H);
+	if(texture == nullptr)
+	{
+		printf("SDL_CreateTexture error: %s\n", SDL_GetError());
+		SDL_DestroyRenderer(renderer);
+		renderer = nullptr;
+		renderState.store(-1);
+		return;
+	}
+
+	renderState.store(1);
+
+	int frameFront = 2; // The emulation side starts on 0 with 1 in the middle.
+	bool textureHires = false;
+	unsigned int framesFinished = 0;
+	auto start = std::chrono::high_resolution_clock::now();
+
+	while(renderActive.load(std::memory_order_acquire))
+	{
+		if(framePublish.load(std::memory_order_acquire) & FRAME_FRESH)
+		{
+			uint32_t previous = framePublish.exchange(frameFront, std::memory_order_acq_rel);
+			frameFront = previous & FRAME_INDEX_MASK;
+
+			const Frame &frame = frameBuffers[frameFront];
+			uint64_t dirty = frame.dirty;
+			if(frame.background != paletteBackground || frame.foreground != paletteForeground)
+			{
+				// The colors changed since the palette was last built; rebuild
+				// it here, on the thread that reads it, and reconvert everything.
+				RebuildPalette(frame.background, frame.foreground);
+				dirty = ~0ull;
+			}
+			if((frame.hires != 0) != textureHires)
+			{
+				// The resolution changed; rebuild the texture at the new
+				// dimensions and reconvert everything.
+				textureHires = frame.hires != 0;
+				SDL_DestroyTexture(texture);
+				texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_RGB888, SDL_TEXTUREACCESS_STREAMING,
+					textureHires ? HIRES_W : W, textureHires ? HIRES_H : H);
+				dirty = ~0ull;
+			}
+
+			int width = textureHires ? HIRES_W : W;
+			int minRow, maxRow;
+			if(DirtySpan(dirty, textureHires ? HIRES_H : H, minRow, maxRow))
+			{
+				// Convert straight into the mapped texture rows instead of
+				// bouncing through an intermediate pixel buffer.
+				SDL_Rect rect = {0, minRow, width, maxRow-minRow+1};
+				void *mapped;
+				int pitch;
+				if(SDL_LockTexture(texture, &rect, &mapped, &pitch) == 0)
+				{
+					if(textureHires)
+					{
+						ConvertDisplay<ResHigh>(frame.rows, minRow, maxRow, (uint32_t *)mapped, pitch/(int)sizeof(uint32_t));
+					}else{
+						ConvertDisplay<ResLow>(frame.rows, minRow, maxRow, (uint32_t *)mapped, pitch/(int)sizeof(uint32_t));
+					}
+					SDL_UnlockTexture(texture);
+				}
+			}
+		}
+
+		//SDL_RenderClear(renderer);
+		SDL_RenderCopy(renderer, texture, NULL, NULL);
+		SDL_RenderPresent(renderer);
+
+		framesFinished++;
+		// With vsync the present above already blocked until the flip.
+		if(!vsync) WaitUntil(start + std::chrono::nanoseconds(1000000000ULL/FPS) * framesFinished);
+	}
+
+	SDL_DestroyTexture(texture);
+	texture = nullptr;
+	SDL_DestroyRenderer(renderer);
+	renderer = nullptr;
+}
+
+// Maps an SDL scancode to a CHIP-8 key, or -1. A flat switch the compiler
+// turns into a jump table; nothing is constructed at startup.
+static int MapScancode(int scancode)
+{
+	switch(scancode)
+	{
+		case SDL_SCANCODE_1: return 0x1;
+		case SDL_SCANCODE_2: return 0x2;
+		case SDL_SCANCODE_3: return 0x3;
+		case SDL_SCANCODE_4: return 0xC;
+		case SDL_SCANCODE_Q: return 0x4;
+		case SDL_SCANCODE_W: return 0x5;
+		case SDL_SCANCODE_E: return 0x6;
+		case SDL_SCANCODE_R: return 0xD;
+		case SDL_SCANCODE_A: return 0x7;
+		case SDL_SCANCODE_S: return 0x8;
+		case SDL_SCANCODE_D: return 0x9;
+		case SDL_SCANCODE_F: return 0xE;
+		case SDL_SCANCODE_Z: return 0xA;
+		case SDL_SCANCODE_X: return 0x0;
+		case SDL_SCANCODE_C: return 0xB;
+		case SDL_SCANCODE_V: return 0xF;
+	}
+
+	return -1;
+}
+
+// Drain pending window events. Returns false once the window is closed.
+bool Chip8::PollEvents()
+{
+	SDL_Event event;
+	bool running = true;
+
+	while(SDL_PollEvent(&event))
+	{
+		switch(event.type)
+		{
+			case SDL_QUIT:
+				running = false;
+				break;
+			case SDL_KEYUP:
+			case SDL_KEYDOWN:
+				if(event.type == SDL_KEYDOWN)
+				{
+#ifdef CHIP8_PROFILE
+					// F3 dumps the profile collected so far.
+					if(event.key.keysym.scancode == SDL_SCANCODE_F3)
+					{
+						DumpProfile();
+						break;
+					}
+#endif
+					// F4 dumps the trace ring collected so far.
+					if(event.key.keysym.scancode == SDL_SCANCODE_F4 && traceEnabled && traceFile.length() > 0)
+					{
+						DumpTrace(traceFile);
+						break;
+					}
+					// F10 rotates to the next program in the loaded library.
+					if(event.key.keysym.scancode == SDL_SCANCODE_F10 && libraryCount > 0)
+					{
+						LoadProgramFromLibrary((libraryIndex+1) % libraryCount);
+						break;
+					}
+					// Quick savestate hotkeys: F5 saves, F9 restores.
+					if(event.key.keysym.scancode == SDL_SCANCODE_F5)
+					{
+						SaveState(quickSlot);
+						quickSlotUsed = true;
+						printf("State saved.\n");
+						break;
+					}else if(event.key.keysym.scancode == SDL_SCANCODE_F9)
+					{
+						if(quickSlotUsed)
+						{
+							LoadState(quickSlot);
+						}else{
+							printf("No state to load.\n");
+						}
+						break;
+					}
+				}
+
+				int key = MapScancode(event.key.keysym.scancode);
+				if(key < 0) break;
+
+				// Only the edge is recorded here; ApplyPendingKeys() folds
+				// it into the keys bitfield at the frame boundary.
+				SetKey(key & 0xF, event.type == SDL_KEYDOWN);
+		}
+	}
+
+	return running;
+}
+
+void Chip8::SubmitCommand(const std::string &line)
+{
+	std::lock_guard<std::mutex> lock(serverMutex);
+	serverQueue.push_back(line);
+}
+
+// Drains the queued command lines. Runs on the emulation thread on a frame
+// boundary, so every command sees quiescent machine state and a ROM swap is
+// visible on the very next present.
+void Chip8::ApplyServerCommands()
+{
+	std::vector<std::string> commands;
+	{
+		std::lock_guard<std::mutex> lock(serverMutex);
+		commands.swap(serverQueue);
+	}
+
+	for(auto &command: commands) RunServerCommand(command);
+}
+
+void Chip8::RunServerCommand(const std::string &line)
+{
+	std::istringstream fields(line);
+	std::string command;
+	if(!(fields >> command)) return;
+
+	if(command == "load")
+	{
+		std::string path;
+		fields >> path;
+
+		// LoadProgram() resets on success, so the swap lands warm: the window,
+		// renderer, texture and audio device are all left standing.
+		bool ok = path.length() > 0 && LoadProgram(path);
+		if(ok) serverPaused = false;
+		printf("server\tload\t%s\n", ok ? "ok" : "error");
+	}else if(command == "load-index")
+	{
+		uint32_t index;
+		bool ok = (fields >> index) && LoadProgramFromLibrary(index);
+		if(ok) serverPaused = false;
+		printf("server\tload-index\t%s\n", ok ? "ok" : "error");
+	}else if(command == "reset")
+	{
+		Reset();
+		serverPaused = false;
+		printf("server\treset\tok\n");
+	}else if(command == "colors")
+	{
+		std::string bg, fg;
+		if(fields >> bg >> fg)
+		{
+			try
+			{
+				uint32_t bgColor = std::stoul(bg, nullptr, 16);
+				uint32_t fgColor = std::stoul(fg, nullptr, 16);
+				SetBackgroundColor(bgColor);
+				SetForegroundColor(fgColor);
+				printf("server\tcolors\tok\n");
+				return;
+			}catch(std::exception&){}
+		}
+		printf("server\tcolors\terror\n");
+	}else if(command == "pause")
+	{
+		serverPaused = true;
+		printf("server\tpause\tok\n");
+	}else if(command == "resume")
+	{
+		serverPaused = false;
+		printf("server\tresume\tok\n");
+	}else if(command == "stats")
+	{
+		printf("server\tstats\tcycles=%llu\thash=%016llX\thalted=%d\tpaused=%d\n",
+			(unsigned long long)cyclesExecuted, (unsigned long long)GetDisplayHash(),
+			halt ? 1 : 0, serverPaused ? 1 : 0);
+	}else if(command == "quit")
+	{
+		serverQuit = true;
+		printf("server\tquit\tok\n");
+	}else{
+		printf("server\terror\tunknown command: %s\n", command.c_str());
+	}
+}
+
+void Chip8::Run()
+{
+	if(!InitSDL())
+	{
+		CleanupSDL();
+
+		printf("Failed to run: SDL setup failed!\n");
+		return;
+	}
+
+	// Seed the frame queue with the cleared display, then start the render
+	// thread and wait for it to report its renderer as up or failed.
+	PublishFrame();
+	renderState.store(0);
+	renderActive.store(true, std::memory_order_release);
+	renderThread = std::thread(&Chip8::RenderThreadMain, this);
+	while(renderState.load() == 0) std::this_thread::yield();
+
+	if(renderState.load() < 0)
+	{
+		CleanupSDL();
+
+		printf("Failed to run: SDL setup failed!\n");
+		return;
+	}
+
+	init = true; // Created the SDL window successfully!
+
+	bool turbo = (ips == 0);
+	unsigned int insPerFrame = turbo ? TURBO_BATCH : std::max(1u, ips/FPS/2);
+	unsigned int consecutiveIns = 0;
+	unsigned int framesFinished = 0;
+
+	// Timers are accounted in executed cycles: one 60 Hz tick per
+	// cyclesPerTick instructions, so the clock is left out of the hot path.
+	uint64_t cyclesPerTick = std::max(1u, ips/FPS);
+	uint64_t cycleCounter = 0;
+	uint64_t nextTimerTick = cyclesPerTick;
+	replayClock = 0;
+
+	bool running = true;
+	auto start = std::chrono::high_resolution_clock::now();
+
+	if(turbo)
+	{
+		printf("Running program at unlimited IPS.. (turbo)\n");
+	}else{
+		printf("Running program at: %u IPS.. (%u)\n", ips, insPerFrame);
+	}
+
+	ReportStartup();
+
+	// Server mode keeps the loop (and with it the window, renderer and audio
+	// device) alive across halts; commands arrive on frame boundaries.
+	while(running && !serverQuit && (!halt || serverMode))
+	{
+		if(turbo)
+		{
+			// Execute CPU for consecutiveIns OR until the CPU is waiting for a key to be pressed.
+			unsigned int executed = 0;
+			for(unsigned int i=0; i<consecutiveIns && !(waitingKey & WAITINGKEY_FLAG) && !idleSkip && !halt && !serverPaused; i++)
+			{
+				ExecuteInstruction();
+				executed++;
+			}
+
+			// Turbo: one batch of TURBO_BATCH instructions counts as one 60 Hz
+			// frame of virtual time, so timers tick from cycle counts and the
+			// wall clock is only used to limit how often we redraw.
+			if(!halt && !serverPaused)
+			{
+				delayTimer -= (delayTimer != 0);
+				soundTimer -= (soundTimer != 0);
+				PublishAudioState();
+			}
+			idleSkip = false; // Each batch is a full tick, so the spin resolves itself.
+
+			std::chrono::duration<double> elapsedSeconds = std::chrono::high_resolution_clock::now() - start;
+			int frames = int(elapsedSeconds.count() * FPS) - framesFinished;
+			replayClock += executed;
+
+			if(frames > 0)
+			{
+				framesFinished += frames;
+				// Events are drained and applied once per wall-clock frame;
+				// the instruction batches in between run uninterrupted.
+				running = PollEvents();
+				ApplyPendingKeys();
+				if(serverMode) ApplyServerCommands();
+				PublishFrame();
+			}
+
+			consecutiveIns = insPerFrame;
+			// Halted or paused server sessions have nothing to execute; pace
+			// to the next frame instead of spinning through empty batches.
+			if((waitingKey & WAITINGKEY_FLAG) || (serverMode && (halt || serverPaused)))
+			{
+				WaitUntil(start + std::chrono::nanoseconds(1000000000ULL/FPS) * (framesFinished+1));
+			}
+			continue;
+		}
+
+		// Timer registers decrement at a rate of 60 Hz of virtual time. The
+		// batch is split at nextTimerTick so every tick lands on its exact
+		// virtual cycle, matching the headless clock instruction-for-instruction.
+		unsigned int remaining = consecutiveIns;
+		while(true)
+		{
+			while(cycleCounter >= nextTimerTick)
+			{
+				nextTimerTick += cyclesPerTick;
+				delayTimer -= (delayTimer != 0);
+				soundTimer -= (soundTimer != 0);
+				PublishAudioState();
+			}
+
+			if(remaining == 0 || (waitingKey & WAITINGKEY_FLAG) || idleSkip || halt || serverPaused) break;
+
+			uint64_t untilTick = nextTimerTick - cycleCounter;
+			unsigned int chunk = ((uint64_t)remaining < untilTick) ? remaining : (unsigned int)untilTick;
+			for(unsigned int i=0; i<chunk && !(waitingKey & WAITINGKEY_FLAG) && !idleSkip && !halt && !serverPaused; i++)
+			{
+				ExecuteInstruction();
+				cycleCounter++;
+				remaining--;
+			}
+		}
+
+		// The wall clock is consulted once per frame: pacing, redraw and the
+		// event drain all happen on frame boundaries only.
+		std::chrono::duration<double> elapsedSeconds = std::chrono::high_resolution_clock::now() - start;
+		int frames = int(elapsedSeconds.count() * FPS) - framesFinished;
+		if(frames > 0)
+		{
+			framesFinished += frames;
+			running = PollEvents();
+			// Key transitions are stamped with the virtual cycle count so a
+			// recorded session replays on the same schedule.
+			replayClock = cycleCounter;
+			ApplyPendingKeys();
+			if(serverMode) ApplyServerCommands();
+			PublishFrame();
+		}
+
+		consecutiveIns = std::max(1, frames) * insPerFrame;
+		if(waitingKey & WAITINGKEY_FLAG || idleSkip || !frames)
+		{
+			// Pace to the next frame boundary rather than sleeping a fixed
+			// 16 ms, which overshoots by up to a scheduler quantum.
+			WaitUntil(start + std::chrono::nanoseconds(1000000000ULL/FPS) * (framesFinished+1));
+
+			// Virtual time keeps moving while blocked on Fx0A or sleeping
+			// through a busy-wait loop, so the timers still count down.
+			if(waitingKey & WAITINGKEY_FLAG || idleSkip) cycleCounter += cyclesPerTick;
+			idleSkip = false;
+		}
+	}
+
+	printf("Program terminated.\n");
+
+	if(replayRecording) DumpReplay();
+
+#ifdef CHIP8_PROFILE
+	DumpProfile();
+#endif
+
+	CleanupSDL(); // Finished running so destroy the window. SDL still remains initialized until the object is destroyed.
+}
+
+void Chip8::Run(uint64_t maxCycles)
+{
+	// Headless mode: no window, no audio, no frame pacing. Timers are driven
+	// from a virtual 60 Hz clock derived from the executed cycle count so
+	// programs behave the same no matter how fast the host runs them.
+	uint64_t cyclesPerTick = ips ? std::max(1u, ips/FPS) : TURBO_BATCH;
+	// Resume the persisted clock so maxCycles is an absolute target and a run
+	// sliced at checkpoints ticks its timers on the same cycles throughout.
+	uint64_t cycles = headlessClock;
+	uint64_t nextTick = headlessNextTick ? headlessNextTick : cyclesPerTick;
+	uint64_t nextCheckpoint = checkpointInterval ? (cycles/checkpointInterval + 1) * checkpointInterval : 0;
+
+	printf("Running program headless.. (until cycle %llu)\n", (unsigned long long)maxCycles);
+
+	ReportStartup();
+
+	auto start = std::chrono::high_resolution_clock::now();
+
+	while(!halt && cycles < maxCycles)
+	{
+		if(waitingKey & WAITINGKEY_FLAG)
+		{
+			if(pendingPressed == 0 && (!replayActive || replayInputIndex >= replayInput.size()))
+			{
+				// No key press can ever arrive without a window.
+				Halt("Waiting for a key press while running headless");
+				break;
+			}
+			// A press is coming: grant a full tick of virtual time, the same
+			// amount the windowed loop grants per blocked frame.
+			cycles += cyclesPerTick;
+		}else{
+			ExecuteInstruction();
+			cycles++;
+		}
+
+		if(idleSkip)
+		{
+			// Busy-wait detected: grant a tick of virtual time, matching the
+			// windowed loop's blocked-frame accounting so replays line up.
+			idleSkip = false;
+			cycles += cyclesPerTick;
+		}
+
+		while(cycles >= nextTick)
+		{
+			nextTick += cyclesPerTick;
+			// Timer registers decrement at a rate of 60 Hz of virtual time.
+			if(delayTimer) delayTimer--;
+			if(soundTimer) soundTimer--;
+			PublishAudioState();
+			// Key edges injected through SetKey() land on tick boundaries,
+			// the same contract the windowed loop gives real input.
+			ApplyPendingKeys();
+		}
+
+		// Re-apply recorded key transitions at their exact cycle stamps.
+		while(replayActive && replayInputIndex < replayInput.size() && replayInput[replayInputIndex].cycle <= cycles)
+		{
+			uint32_t stamp = replayInput[replayInputIndex].cycle;
+			uint16_t down = 0;
+			uint16_t up = 0;
+			while(replayInputIndex < replayInput.size() && replayInput[replayInputIndex].cycle == stamp)
+			{
+				const ReplayRecord &record = replayInput[replayInputIndex++];
+				if(record.pressed)
+				{
+					down |= 1 << (record.key & 0xF);
+				}else{
+					up |= 1 << (record.key & 0xF);
+				}
+			}
+			ApplyKeyTransitions(down, up);
+		}
+
+		if(checkpointInterval && cycles >= nextCheckpoint)
+		{
+			fprintf(checkpointOut != nullptr ? checkpointOut : stdout,
+				"checkpoint %llu %016llX\n", (unsigned long long)cycles, (unsigned long long)GetDisplayHash());
+			while(nextCheckpoint <= cycles) nextCheckpoint += checkpointInterval;
+		}
+	}
+
+	std::chrono::duration<double> elapsedSeconds = std::chrono::high_resolution_clock::now() - start;
+	double seconds = elapsedSeconds.count();
+
+	uint64_t executed = cycles - headlessClock;
+	headlessClock = cycles;
+	headlessNextTick = nextTick;
+	cyclesExecuted = cycles; // Cumulative since Reset(), across every slice.
+
+	printf("Program terminated.\n");
+	printf("Executed %llu instructions in %.3f seconds (%.0f instructions/second).\n",
+		(unsigned long long)executed, seconds, seconds > 0.0 ? executed/seconds : 0.0);
+
+#ifdef CHIP8_PROFILE
+	DumpProfile();
+#endif
+}
+
+void Chip8::DumpRegisters()
+{
+	printf("Register dump:\n\t  0   1   2   3   4   5   6   7   8   9   A   B   C   D   E   F\nV[]\t= ");
+	for(int i=0; i<MAX_REGISTERS; i++) printf("%03X ", V[i]);
+	printf("\nS[]\t= ");
+	for(int i=0; i<MAX_REGISTERS; i++) printf("%03X ", stack[i]);
+
+	printf("\nSP\t= 0x%X\nI\t= 0x%X\nPC\t= 0x%X\nDT\t= 0x%X\nST\t= 0x%X\n", SP, I, PC, delayTimer, soundTimer);
+}
+
+void Chip8::DumpDisplay()
+{
+	printf("Display dump:");
+
+	int height = hires ? HIRES_H : H;
+	int width = hires ? HIRES_W : W;
+	for(int y=0; y<height; y++)
+	{
+		printf("\n%2d: ", y+1);
+
+		for(int x=0; x<width; x++)
+		{
+			if((display[y][x/64] >> (63 - (x%64))) & 0x1)
+				printf("X "); // Pixel set.
+			else
+				printf("- "); // Pixel unset.
+		}
+	}
+	printf("\n");
+}
+
+void Chip8::Halt(const char *reason)
+{
+	halt = true;
+	haltReason = reason;
+
+	printf("Program halted: %s\n", reason);
+
+	if(traceEnabled && traceFile.length() > 0) DumpTrace(traceFile);
+
+	if(debug)
+	{
+		DumpRegisters();
+	}
+}
+
+void PrintDebugHelp()
+{
+	printf("Debug mode is enabled. Use the following commands to execute the program:\n h - display this message\n n - continue to next instruction\n r - show all register values\n c - continue until a breakpoint, watchpoint or interrupt\n b addr - toggle a breakpoint at the hexadecimal address\n w addr - toggle a watchpoint on writes to the hexadecimal address\n d - show display state\n q - Stop debugger\n");
+}
+
+// Return true to execute the next instruction, false otherwise.
+bool Chip8::DebuggerHandler()
+{
+	if(debugState == DebugState_Run)
+	{
+		// One word test per instruction while free-running.
+		if(!(breakpoints[PC >> 6] & (1ull << (PC & 63)))) return true;
+
+		printf("Breakpoint hit at 0x%03X.\n", PC);
+		debugState = DebugState_StepInto;
+	}
+
+	static bool once = false;
+	if(!once)
+	{
+		once = true;
+		PrintDebugHelp();
+	}
+
+	std::string command;
+	while(true)
+	{
+		printf(":");
+		std::cin >> command;
+		char c = command.at(0);
+		if(c == 'h')
+		{
+			// Requested help.
+			PrintDebugHelp();
+		}else if(c == 'n')
+		{
+			// Execute the next instruction.
+			break;
+		}else if(c == 'r')
+		{
+			// Show the value of all registers.
+			DumpRegisters();
+		}else if(c == 'c')
+		{
+			// Continue executing instructions until interrupted.
+			debugState = DebugState_Run;
+			break;
+		}else if(c == 'd')
+		{
+			// Show the display state.
+			DumpDisplay();
+		}else if(c == 'b' || c == 'w')
+		{
+			// Toggle a breakpoint or write watchpoint at an address.
+			std::string arg;
+			std::cin >> arg;
+
+			unsigned long address;
+			try
+			{
+				address = std::stoul(arg, nullptr, 16);
+			}catch(std::exception&)
+			{
+				address = MAX_MEMORY;
+			}
+			if(address >= MAX_MEMORY)
+			{
+				printf("Address must be a hexadecimal number between 0-FFF.\n");
+				continue;
+			}
+
+			uint64_t *bits = (c == 'b') ? breakpoints : watchpoints;
+			bits[address >> 6] ^= 1ull << (address & 63);
+			bool set = (bits[address >> 6] >> (address & 63)) & 0x1;
+
+			if(c == 'w')
+			{
+				watchActive = false;
+				for(auto word: watchpoints)
+				{
+					if(word) watchActive = true;
+				}
+			}
+
+			printf("%s 0x%03lX %s.\n", (c == 'b') ? "Breakpoint" : "Watchpoint",
+				address, set ? "set" : "cleared");
+		}else if(c == 'q')
+		{
+			halt = true;
+			return false;
+		}
+	}
+
+	return true;
+}
+
+void Chip8::CheckWatchpoints(uint16_t first, uint16_t last)
+{
+	for(uint32_t address=first; address<=last; address++)
+	{
+		uint16_t wrapped = address & (MAX_MEMORY-1);
+		if(watchpoints[wrapped >> 6] & (1ull << (wrapped & 63)))
+		{
+			// PC has already advanced past the store, so back up to the
+			// instruction that actually wrote.
+			printf("Watchpoint hit: write to 0x%03X at PC 0x%03X.\n", wrapped, (uint16_t)(PC-0x02));
+			debugState = DebugState_StepInto;
+			return;
+		}
+	}
+}
+
+Chip8::OpcodeTables::OpcodeTables()
+{
+	for(auto &handler: main) handler = &Chip8::Op_Invalid;
+	for(auto &handler: math) handler = &Chip8::Op_Invalid;
+	for(auto &handler: key) handler = &Chip8::Op_Invalid;
+	for(auto &handler: misc) handler = &Chip8::Op_Invalid;
+
+	main[0x0] = &Chip8::Op_System;
+	main[0x1] = &Chip8::Op_Jump;
+	main[0x2] = &Chip8::Op_Call;
+	main[0x3] = &Chip8::Op_SkipEqualByte;
+	main[0x4] = &Chip8::Op_SkipNotEqualByte;
+	main[0x5] = &Chip8::Op_SkipEqualReg;
+	main[0x6] = &Chip8::Op_LoadByte;
+	main[0x7] = &Chip8::Op_AddByte;
+	main[0x8] = &Chip8::Op_MathDispatch;
+	main[0x9] = &Chip8::Op_SkipNotEqualReg;
+	main[0xA] = &Chip8::Op_LoadI;
+	main[0xB] = &Chip8::Op_JumpV0;
+	main[0xC] = &Chip8::Op_Random;
+	main[0xE] = &Chip8::Op_KeyDispatch;
+	main[0xF] = &Chip8::Op_MiscDispatch;
+
+	math[0x0] = &Chip8::Op_LoadReg;
+	math[0x1] = &Chip8::Op_Or;
+	math[0x2] = &Chip8::Op_And;
+	math[0x3] = &Chip8::Op_Xor;
+	math[0x4] = &Chip8::Op_AddReg;
+	math[0x5] = &Chip8::Op_SubReg;
+	math[0x7] = &Chip8::Op_SubNotBorrow;
+
+	key[0x9E] = &Chip8::Op_SkipKeyPressed;
+	key[0xA1] = &Chip8::Op_SkipKeyNotPressed;
+
+	misc[0x07] = &Chip8::Op_GetDelayTimer;
+	misc[0x0A] = &Chip8::Op_WaitKey;
+	misc[0x15] = &Chip8::Op_SetDelayTimer;
+	misc[0x18] = &Chip8::Op_SetSoundTimer;
+	misc[0x1E] = &Chip8::Op_AddI;
+	misc[0x29] = &Chip8::Op_LoadFont;
+	misc[0x33] = &Chip8::Op_StoreBCD;
+}
+
+// The quirk- and resolution-sensitive handlers are template instantiations, so
+// each profile pair gets its own fully resolved table set with no runtime
+// quirk or resolution checks.
+template<typename Profile, typename Res>
+Chip8::OpcodeTables Chip8::OpcodeTables::Build()
+{
+	OpcodeTables tables;
+
+	tables.main[0xD] = &Chip8::Op_Draw<Profile, Res>;
+	tables.math[0x6] = &Chip8::Op_ShiftRight<Profile>;
+	tables.math[0xE] = &Chip8::Op_ShiftLeft<Profile>;
+	tables.misc[0x55] = &Chip8::Op_StoreRegs<Profile>;
+	tables.misc[0x65] = &Chip8::Op_LoadRegs<Profile>;
+
+	return tables;
+}
+
+// Indexed [quirk mode][hires]; SelectTables() picks the active set.
+const Chip8::OpcodeTables Chip8::quirkResTables[2][2] = {
+	{Chip8::OpcodeTables::Build<Chip8::QuirkOriginal, Chip8::ResLow>(), Chip8::OpcodeTables::Build<Chip8::QuirkOriginal, Chip8::ResHigh>()},
+	{Chip8::OpcodeTables::Build<Chip8::QuirkSCHIP, Chip8::ResLow>(), Chip8::OpcodeTables::Build<Chip8::QuirkSCHIP, Chip8::ResHigh>()},
+};
+
+void Chip8::SetQuirkMode(QuirkMode mode)
+{
+	quirkMode = mode;
+	SelectTables();
+	FlushDecodeCache(); // Cached micro-ops hold handlers from the old table set.
+}
+
+// Switches between 64x32 and SUPER-CHIP 128x64. The spec leaves the display
+// contents across a mode switch undefined; clearing matches most interpreters.
+void Chip8::SetHires(bool enable)
+{
+	if(hires == enable) return;
+
+	hires = enable;
+	SelectTables();
+	FlushDecodeCache();
+	ClearScreen();
+}
+
+void Chip8::ScrollDown(uint8_t amount)
+{
+	int height = hires ? HIRES_H : H;
+	for(int y=height-1; y>=0; y--)
+	{
+		for(int word=0; word<ROW_WORDS; word++)
+		{
+			display[y][word] = (y >= amount) ? display[y-amount][word] : 0;
+		}
+	}
+
+	screenUpdated = true;
+	dirtyRows = ~0ull;
+}
+
+void Chip8::ScrollRight()
+{
+	int height = hires ? HIRES_H : H;
+	for(int y=0; y<height; y++)
+	{
+		if(hires)
+		{
+			display[y][1] = (display[y][1] >> 4)|(display[y][0] << 60);
+		}
+		display[y][0] >>= 4;
+	}
+
+	screenUpdated = true;
+	dirtyRows = ~0ull;
+}
+
+void Chip8::ScrollLeft()
+{
+	int height = hires ? HIRES_H : H;
+	for(int y=0; y<height; y++)
+	{
+		if(hires)
+		{
+			display[y][0] = (display[y][0] << 4)|(display[y][1] >> 60);
+			display[y][1] <<= 4;
+		}else{
+			display[y][0] <<= 4;
+		}
+	}
+
+	screenUpdated = true;
+	dirtyRows = ~0ull;
+}
+
+// Resolve an opcode straight to its leaf handler, so cached dispatch never
+// hops through the secondary tables.
+Chip8::MicroOp Chip8::DecodeOpcode(uint16_t opCode) const
+{
+	MicroOp op;
+	op.opCode = opCode;
+
+	switch((opCode >> 12) & 0xF)
+	{
+		case 0x8: op.handler = quirkTables->math[opCode & 0xF]; break;
+		case 0xE: op.handler = quirkTables->key[opCode & 0xFF]; break;
+		case 0xF: op.handler = quirkTables->misc[opCode & 0xFF]; break;
+		default: op.handler = quirkTables->main[(opCode >> 12) & 0xF]; break;
+	}
+
+	return op;
+}
+
+void Chip8::FlushDecodeCache()
+{
+	for(auto &op: decodeCache) op.handler = nullptr;
+}
+
+void Chip8::InvalidateDecodeRange(uint16_t first, uint16_t last)
+{
+	// An instruction at address a spans a and a+1, so a write to address w
+	// stales the entries at both w-1 and w.
+	int start = std::max((int)first - 1, 0);
+	int end = std::min((int)last, MAX_MEMORY-1);
+	for(int address=start; address<=end; address++)
+	{
+		decodeCache[address].handler = nullptr;
+	}
+}
+
+// The tail of the memory array mirrors the first MEMORY_MIRROR bytes, so a
+// span that runs past 0xFFF wraps with no mask or branch per byte. The low
+// bytes overlay live registers, so the mirror cannot be kept standing; callers
+// refresh it right before reading a span that actually wraps.
+void Chip8::SyncMemoryMirror()
+{
+	std::memcpy(memory + MAX_MEMORY, memory, MEMORY_MIRROR);
+}
+
+void Chip8::ExecuteInstruction()
+{
+	if(halt) return;
+
+	// Instructions should start on even addresses but not all CHIP-8 programs follow that convention.
+	if(!(PC >= PROGRAM_SPACE && PC < MAX_MEMORY))
+	{
+		SANITY_CHECK(false, "PC set to invalid address");
+		return;
+	}
+
+	if(debug)
+	{
+		if(!DebuggerHandler())
+		{
 			return;
 		}
 	}
 
+#ifdef CHIP8_LEGACY_DECODER
 	// All instructions are 2 bytes long and stored in big-endian fashion.
 	uint16_t opCode = (memory[PC] << 8)|memory[PC+1];
+#else
+	// Steady state is one cache load and a dispatch; the raw big-endian fetch
+	// and handler resolution only happen the first time an address runs.
+	MicroOp &op = decodeCache[PC];
+	if(op.handler == nullptr)
+	{
+		op = DecodeOpcode((memory[PC] << 8)|memory[PC+1]);
+	}
+	uint16_t opCode = op.opCode;
+#endif
 	PC += 2;
 
+	if(traceEnabled)
+	{
+		// One masked store and an index bump per instruction.
+		TraceRecord &record = traceBuffer[traceIndex++ & (TRACE_BUFFER_SIZE-1)];
+		record.pc = PC-2;
+		record.opCode = opCode;
+		record.cycle = traceCycle++;
+	}
+
+#ifdef CHIP8_PROFILE
+	uint8_t family = (opCode >> 12) & 0xF;
+	profileFamilyCount[family]++;
+	profileAddressCount[(PC-2) & (MAX_MEMORY-1)]++;
+	uint64_t ticks = ReadTSC();
+#endif
+
+#ifdef CHIP8_LEGACY_DECODER
+	ExecuteInstructionLegacy(opCode);
+#else
+	// The cached handler is already the leaf, never a family dispatcher.
+	(this->*op.handler)(opCode);
+#endif
+
+#ifdef CHIP8_PROFILE
+	profileFamilyTicks[family] += ReadTSC() - ticks;
+#endif
+}
+
+void Chip8::Op_Invalid(uint16_t opCode)
+{
+	SANITY_CHECK(false, "Unhandled opcode");
+	printf("Unhandled opcode: 0x%04X\n", opCode);
+}
+
+void Chip8::Op_System(uint16_t opCode)
+{
+	if(opCode == 0x00E0)
+	{
+		PRINT_DEBUG_INSTRUCTION(PC, opCode, "00E0 - CLS: Clear the display.");
+
+		ClearScreen();
+	}else if(opCode == 0x00EE)
+	{
+		PRINT_DEBUG_INSTRUCTION(PC, opCode, "00EE - RET: Return from a subroutine.");
+		SANITY_CHECK(SP > 0, "Stack out of bounds");
+
+		PC = stack[SP--];
+	}else if(opCode == 0x00FE)
+	{
+		PRINT_DEBUG_INSTRUCTION(PC, opCode, "00FE - LOW: Disable 128x64 hi-res mode.");
+
+		SetHires(false);
+	}else if(opCode == 0x00FF)
+	{
+		PRINT_DEBUG_INSTRUCTION(PC, opCode, "00FF - HIGH: Enable 128x64 hi-res mode.");
+
+		SetHires(true);
+	}else if(opCode == 0x00FB)
+	{
+		PRINT_DEBUG_INSTRUCTION(PC, opCode, "00FB - SCR: Scroll the display right by 4 pixels.");
+
+		ScrollRight();
+	}else if(opCode == 0x00FC)
+	{
+		PRINT_DEBUG_INSTRUCTION(PC, opCode, "00FC - SCL: Scroll the display left by 4 pixels.");
+
+		ScrollLeft();
+	}else if((opCode & 0xFFF0) == 0x00C0)
+	{
+		PRINT_DEBUG_INSTRUCTION(PC, opCode, "00Cn - SCD nibble: Scroll the display down by n pixels.");
+
+		ScrollDown(opCode & 0xF);
+	}else{
+		PRINT_DEBUG_INSTRUCTION(PC, opCode, "0nnn - SYS addr: Jump to a machine code routine at nnn. Skipped instruction.");
+	}
+}
+
+void Chip8::Op_Jump(uint16_t opCode)
+{
+	PRINT_DEBUG_INSTRUCTION(PC, opCode, "1nnn - JP addr: Jump to location nnn.");
+
+	uint16_t nnn = opCode & 0xFFF;
+	uint16_t head = PC - 2; // Address of this jump instruction.
+
+	// A short backward jump taken over and over is a busy-wait candidate.
+	// Only inspect the loop body once it has spun for a while.
+	if(idleSkipEnabled && nnn <= head && head - nnn <= IDLE_LOOP_SPAN)
+	{
+		if(nnn == idleLoopHead)
+		{
+			if(++idleLoopHits >= IDLE_LOOP_THRESHOLD)
+			{
+				idleLoopHits = 0;
+				if(IsIdleLoop(nnn, head)) idleSkip = true;
+			}
+		}else{
+			idleLoopHead = nnn;
+			idleLoopHits = 0;
+		}
+	}
+
+	PC = nnn;
+}
+
+// Does the loop spanning [start, end] only read the delay timer or keys?
+// Such a loop cannot make progress until the next timer tick or key event,
+// so it is safe to sleep through instead of executing.
+bool Chip8::IsIdleLoop(uint16_t start, uint16_t end) const
+{
+	for(uint16_t addr=start; addr<=end; addr+=2)
+	{
+		uint16_t opCode = (memory[addr] << 8)|memory[addr+1];
+		uint8_t w = (opCode >> 12) & 0xF;
+		uint8_t kk = opCode & 0xFF;
+
+		switch(w)
+		{
+			case 0x1: // JP (the loop's own jump).
+			case 0x3: // SE Vx, byte.
+			case 0x4: // SNE Vx, byte.
+			case 0x5: // SE Vx, Vy.
+			case 0x9: // SNE Vx, Vy.
+				break;
+			case 0xE: // SKP/SKNP read the key state.
+				if(kk != 0x9E && kk != 0xA1) return false;
+				break;
+			case 0xF: // LD Vx, DT reads the delay timer.
+				if(kk != 0x07) return false;
+				break;
+			default:
+				return false;
+		}
+	}
+
+	return true;
+}
+
+void Chip8::Op_Call(uint16_t opCode)
+{
+	PRINT_DEBUG_INSTRUCTION(PC, opCode, "2nnn - CALL addr: Call subroutine at nnn.");
+	SANITY_CHECK(SP < STACK_SIZE-1, "Stack overflow");
+
+	stack[++SP] = PC;
+	PC = opCode & 0xFFF;
+}
+
+void Chip8::Op_SkipEqualByte(uint16_t opCode)
+{
+	PRINT_DEBUG_INSTRUCTION(PC, opCode, "3xkk - SE Vx, byte: Skip next instruction if Vx = kk.");
+
+	if(V[(opCode >> 8) & 0xF] == (opCode & 0xFF)) PC += 2;
+}
+
+void Chip8::Op_SkipNotEqualByte(uint16_t opCode)
+{
+	PRINT_DEBUG_INSTRUCTION(PC, opCode, "4xkk - SNE Vx, byte: Skip next instruction if Vx != kk.");
+
+	if(V[(opCode >> 8) & 0xF] != (opCode & 0xFF)) PC += 2;
+}
+
+void Chip8::Op_SkipEqualReg(uint16_t opCode)
+{
+	if((opCode & 0xF) != 0x0)
+	{
+		Op_Invalid(opCode);
+		return;
+	}
+
+	PRINT_DEBUG_INSTRUCTION(PC, opCode, "5xy0 - SE Vx, Vy: Skip next instruction if Vx = Vy.");
+
+	if(V[(opCode >> 8) & 0xF] == V[(opCode >> 4) & 0xF]) PC += 2;
+}
+
+void Chip8::Op_LoadByte(uint16_t opCode)
+{
+	PRINT_DEBUG_INSTRUCTION(PC, opCode, "6xkk - LD Vx, byte: Set Vx = kk.");
+
+	V[(opCode >> 8) & 0xF] = opCode & 0xFF;
+}
+
+void Chip8::Op_AddByte(uint16_t opCode)
+{
+	PRINT_DEBUG_INSTRUCTION(PC, opCode, "7xkk - ADD Vx, byte: Set Vx = Vx + kk.");
+
+	V[(opCode >> 8) & 0xF] += opCode & 0xFF;
+}
+
+void Chip8::Op_MathDispatch(uint16_t opCode)
+{
+	(this->*quirkTables->math[opCode & 0xF])(opCode);
+}
+
+void Chip8::Op_LoadReg(uint16_t opCode)
+{
+	PRINT_DEBUG_INSTRUCTION(PC, opCode, "8xy0 - LD Vx, Vy: Set Vx = Vy.");
+
+	V[(opCode >> 8) & 0xF] = V[(opCode >> 4) & 0xF];
+}
+
+void Chip8::Op_Or(uint16_t opCode)
+{
+	PRINT_DEBUG_INSTRUCTION(PC, opCode, "8xy1 - OR Vx, Vy: Set Vx = Vx OR Vy.");
+
+	V[(opCode >> 8) & 0xF] |= V[(opCode >> 4) & 0xF];
+}
+
+void Chip8::Op_And(uint16_t opCode)
+{
+	PRINT_DEBUG_INSTRUCTION(PC, opCode, "8xy2 - AND Vx, Vy: Set Vx = Vx AND Vy.");
+
+	V[(opCode >> 8) & 0xF] &= V[(opCode >> 4) & 0xF];
+}
+
+void Chip8::Op_Xor(uint16_t opCode)
+{
+	PRINT_DEBUG_INSTRUCTION(PC, opCode, "8xy3 - XOR Vx, Vy: Set Vx = Vx XOR Vy.");
+
+	V[(opCode >> 8) & 0xF] ^= V[(opCode >> 4) & 0xF];
+}
+
+void Chip8::Op_AddReg(uint16_t opCode)
+{
+	PRINT_DEBUG_INSTRUCTION(PC, opCode, "8xy4 - ADD Vx, Vy: Set Vx = Vx + Vy, set VF = carry.");
+
+	uint8_t x = (opCode >> 8) & 0xF;
+	uint16_t sum = V[x] + V[(opCode >> 4) & 0xF];
+	V[0xF] = (sum >> 8);
+	V[x] = sum & 0xFF;
+}
+
+void Chip8::Op_SubReg(uint16_t opCode)
+{
+	PRINT_DEBUG_INSTRUCTION(PC, opCode, "8xy5 - SUB Vx, Vy: Set Vx = Vx - Vy, set VF = NOT borrow.");
+
+	uint8_t x = (opCode >> 8) & 0xF;
+	uint16_t sub = V[x] - V[(opCode >> 4) & 0xF];
+	V[0xF] = !(sub >> 8);
+	V[x] = sub & 0xFF;
+}
+
+template<typename Profile>
+void Chip8::Op_ShiftRight(uint16_t opCode)
+{
+	PRINT_DEBUG_INSTRUCTION(PC, opCode, "8xy6 - SHR Vx {, Vy}: Set Vx = Vy SHR 1.");
+
+	uint8_t src = Profile::SHIFT_USES_VY ? (opCode >> 4) & 0xF : (opCode >> 8) & 0xF;
+	V[0xF] = V[src] & 0x1;
+	V[(opCode >> 8) & 0xF] = V[src] >> 1;
+}
+
+void Chip8::Op_SubNotBorrow(uint16_t opCode)
+{
+	PRINT_DEBUG_INSTRUCTION(PC, opCode, "8xy7 - SUBN Vx, Vy: Set Vx = Vy - Vx, set VF = NOT borrow.");
+
+	uint8_t x = (opCode >> 8) & 0xF;
+	uint16_t sub = V[(opCode >> 4) & 0xF] - V[x];
+	V[0xF] = !(sub >> 8);
+	V[x] = sub & 0xFF;
+}
+
+template<typename Profile>
+void Chip8::Op_ShiftLeft(uint16_t opCode)
+{
+	PRINT_DEBUG_INSTRUCTION(PC, opCode, "8xyE - SHL Vx {, Vy}: Set Vx = Vy SHL 1.");
+
+	uint8_t src = Profile::SHIFT_USES_VY ? (opCode >> 4) & 0xF : (opCode >> 8) & 0xF;
+	V[0xF] = V[src] >> 7;
+	V[(opCode >> 8) & 0xF] = V[src] << 1;
+}
+
+void Chip8::Op_SkipNotEqualReg(uint16_t opCode)
+{
+	if((opCode & 0xF) != 0x0)
+	{
+		Op_Invalid(opCode);
+		return;
+	}
+
+	PRINT_DEBUG_INSTRUCTION(PC, opCode, "9xy0 - SNE Vx, Vy: Skip next instruction if Vx != Vy.");
+
+	if(V[(opCode >> 8) & 0xF] != V[(opCode >> 4) & 0xF]) PC += 2;
+}
+
+void Chip8::Op_LoadI(uint16_t opCode)
+{
+	PRINT_DEBUG_INSTRUCTION(PC, opCode, "Annn - LD I, addr: Set I = nnn.");
+
+	I = opCode & 0xFFF;
+}
+
+void Chip8::Op_JumpV0(uint16_t opCode)
+{
+	PRINT_DEBUG_INSTRUCTION(PC, opCode, "Bnnn - JP V0, addr: Jump to location nnn + V0.");
+
+	PC = (opCode & 0xFFF) + V[0];
+
+	if(PC < PROGRAM_SPACE)
+	{
+		printf("PC = 0x%X\n", PC);
+		getchar();
+	}
+}
+
+void Chip8::Op_Random(uint16_t opCode)
+{
+	PRINT_DEBUG_INSTRUCTION(PC, opCode, "Cxkk - RND Vx, byte: Set Vx = random byte AND kk.");
+
+	V[(opCode >> 8) & 0xF] = RandomByte() & (opCode & 0xFF);
+}
+
+template<typename Profile, typename Res>
+void Chip8::Op_Draw(uint16_t opCode)
+{
+	PRINT_DEBUG_INSTRUCTION(PC, opCode, "Dxyn - DRW Vx, Vy, nibble: Display n-byte sprite starting at memory location I at (Vx, Vy), set VF = collision.");
+
+	uint8_t z = opCode & 0xF;
+	// SUPER-CHIP: Dxy0 in hi-res mode draws a 16x16 sprite, two bytes per row.
+	// On the original interpreter n=0 draws nothing, so that stays a no-op.
+	bool wide = (z == 0 && Res::WORDS == 2);
+	int rows = (z == 0) ? (Profile::DXY0_16_ROWS ? 16 : 0) : z;
+
+	// Mask once and let a wrapping sprite run into the mirrored tail, instead
+	// of masking every byte inside the loop.
+	uint16_t base = I & (MAX_MEMORY-1);
+	if(base + rows*(wide ? 2 : 1) > MAX_MEMORY) SyncMemoryMirror();
+
+	V[0xF] = 0x0;
+	uint8_t pixelX = V[(opCode >> 8) & 0xF];
+	uint8_t pixelY = V[(opCode >> 4) & 0xF];
+	for(int height=0; height<rows; height++)
+	{
+		// One sprite row is 8 (or 16) pixels: place the bytes at the left edge
+		// of the row and rotate them into position, so horizontal wrap is free.
+		int rowIndex = (pixelY+height) % Res::H;
+
+		if(Res::WORDS == 1)
+		{
+			uint64_t bits = RotateRight64((uint64_t)memory[base+height] << 56, pixelX);
+			uint64_t &row = display[rowIndex][0];
+
+			if(row & bits) V[0xF] = 0x1; // Set VF to 1 if any pixels are unset.
+			row ^= bits;
+		}else{
+			uint64_t b0;
+			if(wide)
+			{
+				b0 = ((uint64_t)memory[base+height*2] << 56)|((uint64_t)memory[base+height*2+1] << 48);
+			}else{
+				b0 = (uint64_t)memory[base+height] << 56;
+			}
+			uint64_t b1 = 0;
+			RotateRight128(b0, b1, pixelX);
+
+			if((display[rowIndex][0] & b0)|(display[rowIndex][1] & b1)) V[0xF] = 0x1;
+			display[rowIndex][0] ^= b0;
+			display[rowIndex][1] ^= b1;
+		}
+
+		dirtyRows |= (1ull << rowIndex);
+	}
+
+	screenUpdated = true;
+}
+
+// Instantiated explicitly so the benchmark harness can link against each pair.
+template void Chip8::Op_Draw<Chip8::QuirkOriginal, Chip8::ResLow>(uint16_t);
+template void Chip8::Op_Draw<Chip8::QuirkOriginal, Chip8::ResHigh>(uint16_t);
+template void Chip8::Op_Draw<Chip8::QuirkSCHIP, Chip8::ResLow>(uint16_t);
+template void Chip8::Op_Draw<Chip8::QuirkSCHIP, Chip8::ResHigh>(uint16_t);
+
+void Chip8::Op_KeyDispatch(uint16_t opCode)
+{
+	(this->*quirkTables->key[opCode & 0xFF])(opCode);
+}
+
+void Chip8::Op_SkipKeyPressed(uint16_t opCode)
+{
+	PRINT_DEBUG_INSTRUCTION(PC, opCode, "Ex9E - SKP Vx: Skip next instruction if key with the value of Vx is pressed.");
+
+	if(keys & (1 << V[(opCode >> 8) & 0xF])) PC += 2;
+}
+
+void Chip8::Op_SkipKeyNotPressed(uint16_t opCode)
+{
+	PRINT_DEBUG_INSTRUCTION(PC, opCode, "ExA1 - SKNP Vx: Skip next instruction if key with the value of Vx is not pressed.");
+
+	if(!(keys & (1 << V[(opCode >> 8) & 0xF]))) PC += 2;
+}
+
+void Chip8::Op_MiscDispatch(uint16_t opCode)
+{
+	(this->*quirkTables->misc[opCode & 0xFF])(opCode);
+}
+
+void Chip8::Op_GetDelayTimer(uint16_t opCode)
+{
+	PRINT_DEBUG_INSTRUCTION(PC, opCode, "Fx07 - LD Vx, DT: Set Vx = delay timer value.");
+
+	V[(opCode >> 8) & 0xF] = delayTimer;
+}
+
+void Chip8::Op_WaitKey(uint16_t opCode)
+{
+	PRINT_DEBUG_INSTRUCTION(PC, opCode, "Fx0A - LD Vx, K: Wait for a key press, store the value of the key in Vx.");
+
+	waitingKey = WAITINGKEY_FLAG|((opCode >> 8) & 0xF);
+}
+
+void Chip8::Op_SetDelayTimer(uint16_t opCode)
+{
+	PRINT_DEBUG_INSTRUCTION(PC, opCode, "Fx15 - LD DT, Vx: Set delay timer = Vx.");
+
+	delayTimer = V[(opCode >> 8) & 0xF];
+}
+
+void Chip8::Op_SetSoundTimer(uint16_t opCode)
+{
+	PRINT_DEBUG_INSTRUCTION(PC, opCode, "Fx18 - LD ST, Vx: Set sound timer = Vx.");
+
+	soundTimer = V[(opCode >> 8) & 0xF];
+	PublishAudioState();
+}
+
+void Chip8::Op_AddI(uint16_t opCode)
+{
+	PRINT_DEBUG_INSTRUCTION(PC, opCode, "Fx1E - ADD I, Vx: Set I = I + Vx.");
+
+	I += V[(opCode >> 8) & 0xF];
+}
+
+void Chip8::Op_LoadFont(uint16_t opCode)
+{
+	PRINT_DEBUG_INSTRUCTION(PC, opCode, "Fx29 - LD F, Vx: Set I = location of sprite for digit Vx.");
+
+	I = &font[(V[(opCode >> 8) & 0xF] & 0xF)*5] - memory;
+}
+
+void Chip8::Op_StoreBCD(uint16_t opCode)
+{
+	PRINT_DEBUG_INSTRUCTION(PC, opCode, "Fx33 - LD B, Vx: Store BCD representation of Vx in memory locations I, I+1, and I+2.");
+
+	uint8_t x = (opCode >> 8) & 0xF;
+	uint16_t base = I & (MAX_MEMORY-1);
+	if(base+2 < MAX_MEMORY)
+	{
+		memory[base] = (V[x] / 100) % 10;
+		memory[base+1] = (V[x] / 10) % 10;
+		memory[base+2] = V[x] % 10;
+
+		InvalidateDecodeRange(base, base+2);
+		if(watchActive) CheckWatchpoints(base, base+2);
+	}else{
+		// Wrapping writes have to land in the real bytes, not the mirror.
+		memory[base] = (V[x] / 100) % 10;
+		memory[(base+1) & (MAX_MEMORY-1)] = (V[x] / 10) % 10;
+		memory[(base+2) & (MAX_MEMORY-1)] = V[x] % 10;
+
+		FlushDecodeCache(); // The write spans both ends; just drop everything.
+		if(watchActive)
+		{
+			CheckWatchpoints(base, MAX_MEMORY-1);
+			CheckWatchpoints(0, (base+2) & (MAX_MEMORY-1));
+		}
+	}
+}
+
+template<typename Profile>
+void Chip8::Op_StoreRegs(uint16_t opCode)
+{
+	PRINT_DEBUG_INSTRUCTION(PC, opCode, "Fx55 - LD [I], Vx: Store registers V0 through Vx in memory starting at location I.");
+
+	uint8_t x = (opCode >> 8) & 0xF;
+	uint16_t base = I & (MAX_MEMORY-1);
+	if(base+x < MAX_MEMORY)
+	{
+		for(int i=0; i<=x; i++)
+		{
+			memory[base+i] = V[i];
+		}
+		InvalidateDecodeRange(base, base+x);
+		if(watchActive) CheckWatchpoints(base, base+x);
+	}else{
+		// Wrapping writes have to land in the real bytes, not the mirror.
+		for(int i=0; i<=x; i++)
+		{
+			memory[(base+i) & (MAX_MEMORY-1)] = V[i];
+		}
+		FlushDecodeCache(); // The write spans both ends; just drop everything.
+		if(watchActive)
+		{
+			CheckWatchpoints(base, MAX_MEMORY-1);
+			CheckWatchpoints(0, (base+x) & (MAX_MEMORY-1));
+		}
+	}
+
+	if(Profile::LOADSTORE_INCREMENTS_I) I += x+1;
+}
+
+template<typename Profile>
+void Chip8::Op_LoadRegs(uint16_t opCode)
+{
+	PRINT_DEBUG_INSTRUCTION(PC, opCode, "Fx65 - LD Vx, [I]: Read registers V0 through Vx from memory starting at location I.");
+
+	uint8_t x = (opCode >> 8) & 0xF;
+	uint16_t base = I & (MAX_MEMORY-1);
+	if(base+x >= MAX_MEMORY) SyncMemoryMirror();
+
+	for(int i=0; i<=x; i++)
+	{
+		V[i] = memory[base+i];
+	}
+	if(Profile::LOADSTORE_INCREMENTS_I) I += x+1;
+}
+
+#ifdef CHIP8_LEGACY_DECODER
+void Chip8::ExecuteInstructionLegacy(uint16_t opCode)
+{
 	// wxyz wnnn wxkk
 	uint8_t w = (opCode >> 12) & 0xF;
 	uint8_t x = (opCode >> 8) & 0xF;
@@ -692,7 +2641,7 @@ void Chip8::ExecuteInstruction()
 	{
 		PRINT_DEBUG_INSTRUCTION(PC, opCode, "Cxkk - RND Vx, byte: Set Vx = random byte AND kk.");
 
-		V[x] = std::uniform_int_distribution<unsigned int>(0, 255)(rng) & kk;
+		V[x] = RandomByte() & kk;
 	}else if(w == 0xD)
 	{
 		PRINT_DEBUG_INSTRUCTION(PC, opCode, "Dxyn - DRW Vx, Vy, nibble: Display n-byte sprite starting at memory location I at (Vx, Vy), set VF = collision.");
@@ -703,15 +2652,13 @@ void Chip8::ExecuteInstruction()
 		uint8_t pixelY = V[y];
 		for(int height=0; height<z; height++)
 		{
-			uint16_t rowStart = W * ((pixelY+height) % H);
-			for(int bit=0; bit<8; bit++)
-			{
-				uint16_t cell = rowStart + ((pixelX+bit) % W);
+			uint64_t bits = RotateRight64((uint64_t)memory[(I+height) & 0xFFF] << (W-8), pixelX);
+			int rowIndex = (pixelY+height) % H;
+			uint64_t &row = display[rowIndex][0];
 
-				bool pixel = display[cell] ^ ((memory[(I+height) & 0xFFF] >> (7-bit)) & 0x1);
-				if(!pixel && display[cell]) V[0xF] = 0x1; // Set VF to 1 if any pixels are unset.
-				display[cell] = pixel;
-			}
+			if(row & bits) V[0xF] = 0x1; // Set VF to 1 if any pixels are unset.
+			row ^= bits;
+			dirtyRows |= (1ull << rowIndex);
 		}
 
 		screenUpdated = true;
@@ -745,6 +2692,7 @@ void Chip8::ExecuteInstruction()
 		PRINT_DEBUG_INSTRUCTION(PC, opCode, "Fx18 - LD ST, Vx: Set sound timer = Vx.");
 
 		soundTimer = V[x];
+		PublishAudioState();
 	}else if(w == 0xF && kk == 0x1E)
 	{
 		PRINT_DEBUG_INSTRUCTION(PC, opCode, "Fx1E - ADD I, Vx: Set I = I + Vx.");
@@ -763,6 +2711,7 @@ void Chip8::ExecuteInstruction()
 		memory[I] = (V[x] / 100) % 10;
 		memory[I+1] = (V[x] / 10) % 10;
 		memory[I+2] = V[x] % 10;
+		if(watchActive) CheckWatchpoints(I, I+2);
 	}else if(w == 0xF && kk == 0x55)
 	{
 		PRINT_DEBUG_INSTRUCTION(PC, opCode, "Fx55 - LD [I], Vx: Store registers V0 through Vx in memory starting at location I.");
@@ -772,6 +2721,7 @@ void Chip8::ExecuteInstruction()
 		{
 			memory[I+i] = V[i];
 		}
+		if(watchActive) CheckWatchpoints(I, I+x);
 		I += x+1;
 	}else if(w == 0xF && kk == 0x65)
 	{
@@ -791,3 +2741,4 @@ void Chip8::ExecuteInstruction()
 		printf("Unhandled opcode: 0x%04X\n", opCode);
 	}
 }
+#endif // CHIP8_LEGACY_DECODER
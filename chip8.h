@@ -18,9 +18,16 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #pragma once
 
 #include <cstdint>
+#include <cstdio>
 #include <string>
+#include <vector>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <chrono>
+#ifdef CHIP8_MT_RND
 #include <random>
-#include <bitset>
+#endif
 
 struct SDL_Window;
 struct SDL_Renderer;
@@ -34,35 +41,111 @@ public:
 
 	bool LoadProgram(const std::string &fileName);
 	void Run();
+	// Headless execution for benchmarking and batch validation. Runs the CPU
+	// core without any SDL setup until the virtual clock reaches maxCycles
+	// total since the last Reset(); repeated calls resume where the previous
+	// one stopped, so a run sliced into segments matches one long run.
+	void Run(uint64_t maxCycles);
 	void SetBackgroundColor(uint32_t color);
 	void SetForegroundColor(uint32_t color);
+	// ips of 0 runs the CPU as fast as the host allows (turbo).
 	void SetIPS(uint32_t ips) { this->ips = ips; };
 	void SetPixelScale(unsigned int pixelScale) { this->pixelScale = pixelScale; };
+	// Let the GPU pace presents instead of (or on top of) the sleep/spin pacer.
+	void SetVSync(bool enable) { vsync = enable; };
 	void SetPreferredAudioDevice(const std::string &audioDevice) { preferredAudio = audioDevice; };
 
 	void ShowAudioDevices();
 	void SetVolume(float volumeLevel);
 	void EnableDebug(bool enable) { debug = enable; };
+	void EnableIdleSkip(bool enable) { idleSkipEnabled = enable; };
+
+	// Server mode: the windowed run loop survives halts and drains queued
+	// commands once per frame, so a supervisor can hot-swap ROMs against the
+	// warm SDL window and audio device. See RunServerCommand() for the verbs.
+	void EnableServer() { serverMode = true; };
+	// Queue one command line from any thread; applied on a frame boundary.
+	void SubmitCommand(const std::string &line);
+
+	// Quirk behavior for 8xy6/8xyE and Fx55/Fx65. Select before loading a
+	// program; dispatch costs nothing per instruction.
+	enum QuirkMode
+	{
+		Quirk_Original=0,	// Shifts read Vy, Fx55/Fx65 advance I.
+		Quirk_SCHIP,		// Shifts read Vx in place, I is left alone.
+	};
+	void SetQuirkMode(QuirkMode mode);
+
+	// Introspection for batch validation and automated testing.
+	uint64_t GetDisplayHash() const;
+	// Copies all 64 display rows of 2 words each (bit 63 of the first word is
+	// the leftmost pixel) into buffer; low resolution fills word 0 of the
+	// first 32 rows.
+	void GetDisplaySnapshot(uint64_t *buffer) const;
+	uint64_t GetCycleCount() const { return cyclesExecuted; };
+	const std::string &GetHaltReason() const { return haltReason; };
+
+	// Emit the display hash every interval cycles while running headless,
+	// to stdout unless a checkpoint file is set.
+	void SetCheckpointInterval(uint64_t interval) { checkpointInterval = interval; };
+	bool SetCheckpointFile(const std::string &fileName);
+
+	// Report the time from launch (the point the caller captured) to the
+	// first executed instruction once Run() gets there.
+	void TimeStartup(const std::chrono::high_resolution_clock::time_point &launch)
+	{
+		timeStartup = true;
+		startupLaunch = launch;
+	};
 private:
-	static constexpr int W = 64; // Width of the screen in pixels.
-	static constexpr int H = 32; // Height of the screen in pixels.
+	// The microbenchmark harness (bench.cpp, built by `make bench`) drives the
+	// decoder, sprite blit and display conversion in isolation.
+	friend struct Chip8Bench;
+
+	static constexpr int W = 64; // Width of the low resolution screen in pixels.
+	static constexpr int H = 32; // Height of the low resolution screen in pixels.
+	static constexpr int HIRES_W = 128; // SCHIP high resolution (00FF) dimensions.
+	static constexpr int HIRES_H = 64;
+	static constexpr int ROW_WORDS = HIRES_W/64; // 64-bit words per display row.
 	static constexpr int MAX_MEMORY = 0x1000; // Total memory available to the interpreter.
+	// Bytes past MAX_MEMORY mirroring the start of memory, so a span that runs
+	// off the end wraps without masking every access. Sized for the widest
+	// span: a 16-row wide sprite. See SyncMemoryMirror().
+	static constexpr int MEMORY_MIRROR = 32;
 	static constexpr int PROGRAM_SPACE = 0x200; // Program space is 0x200 and onwards.
 	static constexpr int MAX_PROGRAM_SIZE = MAX_MEMORY - PROGRAM_SPACE;
 	static constexpr int STACK_SIZE = 16;
 	static constexpr int MAX_REGISTERS = 16;
 	static constexpr uint8_t WAITINGKEY_FLAG = 0x10;
 	static constexpr unsigned int FPS = 60;
+	// Instructions executed between event polls when running at unlimited IPS.
+	static constexpr unsigned int TURBO_BATCH = 4096;
+	// Longest backward jump (in bytes) still considered a busy-wait loop, and
+	// how many consecutive passes it takes before we inspect one.
+	static constexpr unsigned int IDLE_LOOP_SPAN = 8;
+	static constexpr unsigned int IDLE_LOOP_THRESHOLD = 64;
 
+#ifdef CHIP8_MT_RND
 	std::mt19937 rng;
+#endif
+	// Fast xorshift32 generator used by RND, seeded from the clock at
+	// construction. 32 bits are drawn at a time and served out as four
+	// random bytes.
+	uint32_t rngState;
+	uint32_t rngCache;
+	int rngCacheBytes;
+
+	uint8_t RandomByte();
 	std::string preferredAudio;
-	// Data for the monochrome display.
-	std::bitset<W*H> display;
+	// Data for the monochrome display, stored one row per word pair so sprite
+	// rows can be blitted with whole-word shifts and XORs. Bit 63 of word 0 is
+	// the leftmost pixel; low resolution uses word 0 of the first H rows.
+	uint64_t display[HIRES_H][ROW_WORDS];
 
 	union
 	{
-		// Capable of accessing up to 4KB of RAM.
-		uint8_t memory[MAX_MEMORY] = {0};
+		// Capable of accessing up to 4KB of RAM, plus the mirrored tail.
+		uint8_t memory[MAX_MEMORY + MEMORY_MIRROR] = {0};
 		// The first 512 bytes are reserved for use by the interpreter. (0x00 to 0x1FF)
 		struct
 		{
@@ -89,36 +172,420 @@ private:
 	SDL_Window *window;
 	SDL_Renderer *renderer;
 	SDL_Texture *texture;
+	// This instance brought SDL up, so its destructor owns SDL_Quit().
+	// Headless and batch instances never initialize SDL at all.
+	bool sdlStarted;
 
-	uint32_t *pixels;
 	uint32_t background;
 	uint32_t foreground;
+	// Expands one display byte (8 pixels) to RGBA in a single lookup. Built
+	// by the constructor and after that rebuilt only on the render thread,
+	// from the colors carried in each published frame: the emulation thread
+	// never touches it once rendering is live, so a mid-run color change
+	// (server 'colors') cannot race ConvertDisplay().
+	uint32_t palette[256][8];
+	// The colors the palette currently encodes, owned by whoever last called
+	// RebuildPalette().
+	uint32_t paletteBackground;
+	uint32_t paletteForeground;
+
+	void RebuildPalette(uint32_t bg, uint32_t fg);
 
 	uint32_t ips;
 
+	uint64_t cyclesExecuted;
+	// Headless virtual clock, persisted across Run(maxCycles) calls so a run
+	// sliced at checkpoints follows the same trajectory as one long run.
+	uint64_t headlessClock;
+	uint64_t headlessNextTick;
+	std::string haltReason;
+
+	uint64_t checkpointInterval;
+	FILE *checkpointOut;
+
+	bool timeStartup;
+	std::chrono::high_resolution_clock::time_point startupLaunch;
+	void ReportStartup();
+
+	// Busy-wait detection: when a short backward jump keeps closing the same
+	// loop and the loop only reads the delay timer or keys, the run loop
+	// sleeps to the next timer tick instead of executing the spin.
+	bool idleSkip;
+	bool idleSkipEnabled;
+	uint16_t idleLoopHead;
+	unsigned int idleLoopHits;
+
+	bool IsIdleLoop(uint16_t start, uint16_t end) const;
+
 	bool init;
 	bool screenUpdated;
+	// One bit per display row that changed since the last published frame.
+	uint64_t dirtyRows;
 	bool halt;
 	bool debug;
 	int debugState;
+	// One bit per memory address. Breakpoints stop before the instruction at
+	// the address runs; watchpoints stop after a store touches the address.
+	// A single word test per instruction, and only while debugging.
+	uint64_t breakpoints[MAX_MEMORY/64];
+	uint64_t watchpoints[MAX_MEMORY/64];
+	bool watchActive; // Any watchpoint set; skips the store checks when clear.
+
+	bool serverMode;
+	bool serverPaused; // Execution and timers frozen; rendering continues.
+	bool serverQuit;
+	// Command lines queued by SubmitCommand(), drained on frame boundaries.
+	std::mutex serverMutex;
+	std::vector<std::string> serverQueue;
+
+	void ApplyServerCommands();
+	void RunServerCommand(const std::string &line);
 	unsigned int pixelScale;
+	bool vsync;
 
 	void Reset();
 	void ExecuteInstruction();
 	void SetKey(uint8_t key, bool pressed);
+	void ApplyPendingKeys();
+	bool PollEvents();
+
+	// Input edges recorded by SetKey() during a frame, folded into the keys
+	// bitfield at the next frame boundary by ApplyPendingKeys(). A tap that
+	// starts and ends inside one frame stays pressed for a full frame (its
+	// release is deferred one boundary), so Ex9E/ExA1 polling never misses
+	// it, and key timing is frame-granular and thus reproducible.
+	uint16_t pendingPressed;
+	uint16_t pendingReleased;
+	uint16_t deferredRelease;
+
+	// Quirk profiles resolved at compile time: each profile gets its own set
+	// of dispatch tables, so quirk handling costs no per-instruction branch.
+	struct QuirkOriginal
+	{
+		static constexpr bool SHIFT_USES_VY = true;		// 8xy6/8xyE shift Vy into Vx.
+		static constexpr bool LOADSTORE_INCREMENTS_I = true;	// Fx55/Fx65 advance I.
+		static constexpr bool DXY0_16_ROWS = false;		// Dxy0 draws nothing.
+	};
+	struct QuirkSCHIP
+	{
+		static constexpr bool SHIFT_USES_VY = false;		// Shift Vx in place.
+		static constexpr bool LOADSTORE_INCREMENTS_I = false;	// I is left alone.
+		static constexpr bool DXY0_16_ROWS = true;		// Dxy0 draws a 16-row sprite.
+	};
+
+	// Resolution profiles, handled like the quirk profiles: the draw and
+	// conversion loops are instantiated per resolution and 00FE/00FF just
+	// swap the active table set, so the hot path never checks the mode.
+	struct ResLow
+	{
+		static constexpr int W = 64;
+		static constexpr int H = 32;
+		static constexpr int WORDS = 1;	// 64-bit words per row.
+	};
+	struct ResHigh
+	{
+		static constexpr int W = 128;
+		static constexpr int H = 64;
+		static constexpr int WORDS = 2;
+	};
+
+	// Opcode handlers dispatched through the lookup tables below.
+	typedef void (Chip8::*OpcodeHandler)(uint16_t opCode);
+	struct OpcodeTables
+	{
+		OpcodeTables();
+		template<typename Profile, typename Res> static OpcodeTables Build();
+
+		OpcodeHandler main[16];	// Primary table indexed by the w nibble.
+		OpcodeHandler math[16];	// 8xyz family indexed by z.
+		OpcodeHandler key[256];	// Exkk family indexed by kk.
+		OpcodeHandler misc[256];	// Fxkk family indexed by kk.
+	};
+	// One fully resolved table set per quirk profile and resolution,
+	// indexed by [quirk][hires].
+	static const OpcodeTables quirkResTables[2][2];
+	// Table set selected when a program is loaded or 00FE/00FF executes.
+	const OpcodeTables *quirkTables;
+	QuirkMode quirkMode;
+	bool hires;
+
+	void SelectTables() { quirkTables = &quirkResTables[quirkMode][hires ? 1 : 0]; };
+	void SetHires(bool enable);
+	void ScrollDown(uint8_t amount);
+	void ScrollRight();
+	void ScrollLeft();
+
+	// Predecode cache: one decoded micro-op per program address, filled lazily
+	// on first execution. Steady-state loops fetch one struct and dispatch,
+	// skipping the big-endian byte swap and the secondary dispatch tables.
+	// Entries are invalidated when Fx33/Fx55 stores write program memory.
+	struct MicroOp
+	{
+		OpcodeHandler handler;	// nullptr until the address is decoded.
+		uint16_t opCode;
+	};
+	MicroOp decodeCache[MAX_MEMORY];
+
+	// Refreshes the mirrored tail of memory before a wrapping span is read.
+	void SyncMemoryMirror();
+
+	MicroOp DecodeOpcode(uint16_t opCode) const;
+	void FlushDecodeCache();
+	// Drops the cached micro-ops for instructions overlapping [first, last].
+	void InvalidateDecodeRange(uint16_t first, uint16_t last);
+
+#ifdef CHIP8_LEGACY_DECODER
+	// Original if/else decoder, kept for reference in debug builds.
+	void ExecuteInstructionLegacy(uint16_t opCode);
+#endif
+	void Op_Invalid(uint16_t opCode);
+	void Op_System(uint16_t opCode);
+	void Op_Jump(uint16_t opCode);
+	void Op_Call(uint16_t opCode);
+	void Op_SkipEqualByte(uint16_t opCode);
+	void Op_SkipNotEqualByte(uint16_t opCode);
+	void Op_SkipEqualReg(uint16_t opCode);
+	void Op_LoadByte(uint16_t opCode);
+	void Op_AddByte(uint16_t opCode);
+	void Op_MathDispatch(uint16_t opCode);
+	void Op_LoadReg(uint16_t opCode);
+	void Op_Or(uint16_t opCode);
+	void Op_And(uint16_t opCode);
+	void Op_Xor(uint16_t opCode);
+	void Op_AddReg(uint16_t opCode);
+	void Op_SubReg(uint16_t opCode);
+	template<typename Profile> void Op_ShiftRight(uint16_t opCode);
+	void Op_SubNotBorrow(uint16_t opCode);
+	template<typename Profile> void Op_ShiftLeft(uint16_t opCode);
+	void Op_SkipNotEqualReg(uint16_t opCode);
+	void Op_LoadI(uint16_t opCode);
+	void Op_JumpV0(uint16_t opCode);
+	void Op_Random(uint16_t opCode);
+	template<typename Profile, typename Res> void Op_Draw(uint16_t opCode);
+	void Op_KeyDispatch(uint16_t opCode);
+	void Op_SkipKeyPressed(uint16_t opCode);
+	void Op_SkipKeyNotPressed(uint16_t opCode);
+	void Op_MiscDispatch(uint16_t opCode);
+	void Op_GetDelayTimer(uint16_t opCode);
+	void Op_WaitKey(uint16_t opCode);
+	void Op_SetDelayTimer(uint16_t opCode);
+	void Op_SetSoundTimer(uint16_t opCode);
+	void Op_AddI(uint16_t opCode);
+	void Op_LoadFont(uint16_t opCode);
+	void Op_StoreBCD(uint16_t opCode);
+	template<typename Profile> void Op_StoreRegs(uint16_t opCode);
+	template<typename Profile> void Op_LoadRegs(uint16_t opCode);
 
 	bool InitSDL();
+	// Audio device setup is deferred until a program first arms soundTimer,
+	// so silent launches never pay for it.
+	void InitAudio();
+	bool audioTried;
 	void CleanupSDL();
 
 	void ClearScreen();
-	void DrawScreen();
+	// Bounds the dirty rows of a published frame; returns false if none are.
+	static bool DirtySpan(uint64_t dirty, int height, int &minRow, int &maxRow);
+	// Expands display rows [first, last] to RGBA directly into dest (the
+	// locked texture region), whose rows are pitch uint32s apart. Runs on the
+	// render thread.
+	template<typename Res> void ConvertDisplay(const uint64_t (*rows)[ROW_WORDS], int first, int last, uint32_t *dest, int pitch);
+
+	// Rendering runs on its own thread so a slow GPU present never steals
+	// time from the instruction budget. The emulation loop publishes display
+	// snapshots through a lock-free triple buffer ("latest frame wins"); the
+	// render thread owns the SDL renderer and texture and presents at its own
+	// 60 Hz (or vsync) rate, re-presenting the last frame when nothing new
+	// has been published.
+	struct Frame
+	{
+		uint64_t rows[HIRES_H][ROW_WORDS];
+		uint64_t dirty;
+		// Colors travel with the frame so the render thread rebuilds the
+		// palette itself instead of reading it while the emulation thread
+		// writes it.
+		uint32_t background;
+		uint32_t foreground;
+		uint8_t hires;
+	};
+	static constexpr uint32_t FRAME_INDEX_MASK = 0x3;
+	static constexpr uint32_t FRAME_FRESH = 0x4; // Set while the middle slot holds an unconsumed frame.
+
+	void PublishFrame();
+	void RenderThreadMain();
+
+	Frame frameBuffers[3];
+	// Middle slot of the triple buffer, tagged with FRAME_FRESH on publish.
+	std::atomic<uint32_t> framePublish;
+	int frameBack;
+	// Dirty rows from frames the render thread never consumed, carried into
+	// the next publish so no row update is ever lost.
+	uint64_t frameCarryDirty;
+
+	std::thread renderThread;
+	std::atomic<bool> renderActive;
+	// Startup handshake: 0 = starting, 1 = renderer ready, -1 = failed.
+	std::atomic<int> renderState;
 	void DumpRegisters();
 	void DumpDisplay();
 	void Halt(const char *reason);
 	bool DebuggerHandler();
+	// Breaks back into the debugger if a store to [first, last] hit a watched
+	// address. Call sites guard on watchActive.
+	void CheckWatchpoints(uint16_t first, uint16_t last);
+
+#ifdef CHIP8_PROFILE
+	// Profiling counters, compiled in only when CHIP8_PROFILE is defined so
+	// the hot loop carries zero overhead in normal builds.
+	uint64_t profileFamilyCount[16];
+	uint64_t profileFamilyTicks[16];
+	uint32_t profileAddressCount[MAX_MEMORY];
+
+	void ResetProfile();
+public:
+	void DumpProfile();
+private:
+#endif
+
+public:
+	// Complete machine state in one fixed-size block: the 4 KB memory union
+	// already holds every register, timer and the stack, so saving and
+	// restoring is a straight copy with no heap traffic.
+	struct SaveStateData
+	{
+		uint32_t magic;
+		uint32_t version;
+		uint8_t memory[MAX_MEMORY];
+		uint64_t display[HIRES_H][ROW_WORDS];
+		uint32_t rngState;
+		uint32_t rngCache;
+		int32_t rngCacheBytes;
+		uint8_t halt;
+		uint8_t hires;
+	};
+	static constexpr uint32_t SAVESTATE_MAGIC = 0x43385353; // "C8SS"
+	static constexpr uint32_t SAVESTATE_VERSION = 2; // v2: hi-res display and mode flag.
+
+	void SaveState(SaveStateData &state) const;
+	bool LoadState(const SaveStateData &state);
+	bool SaveStateToFile(const std::string &fileName) const;
+	bool LoadStateFromFile(const std::string &fileName);
+
+	// Packed ROM library ("C8LB"): a header and index followed by the
+	// concatenated ROM images. The file is memory-mapped once at load so
+	// switching programs afterwards is a small copy with no filesystem I/O.
+	struct LibraryHeader
+	{
+		uint32_t magic;
+		uint32_t version;
+		uint32_t count;
+	};
+	struct LibraryEntry
+	{
+		char name[32];
+		uint32_t offset;
+		uint32_t size;
+	};
+	static constexpr uint32_t LIBRARY_MAGIC = 0x424C3843; // "C8LB"
+	static constexpr uint32_t LIBRARY_VERSION = 1;
+
+	bool LoadLibrary(const std::string &fileName);
+	bool LoadProgramFromLibrary(uint32_t index);
+	uint32_t GetLibraryCount() const { return libraryCount; };
+
+	// Flight recorder: a fixed ring of packed (pc, opcode, cycle) records
+	// captured with one store per instruction, cheap enough to leave enabled
+	// in production. Dumped as a binary file ("C8TR") on Halt() or on demand.
+	struct TraceRecord
+	{
+		uint16_t pc;
+		uint16_t opCode;
+		uint32_t cycle;
+	};
+	struct TraceHeader
+	{
+		uint32_t magic;
+		uint32_t version;
+		uint32_t count;
+	};
+	static constexpr uint32_t TRACE_MAGIC = 0x52543843; // "C8TR"
+	static constexpr uint32_t TRACE_VERSION = 1;
+	static constexpr uint32_t TRACE_BUFFER_SIZE = 65536; // Power of two.
+
+	void EnableTrace(const std::string &fileName);
+	bool DumpTrace(const std::string &fileName) const;
+
+	// Deterministic replay ("C8RP"): the xorshift seed, the recorded IPS and
+	// every key state transition stamped with the virtual cycle count it was
+	// applied at. Playback re-injects the transitions at the exact same
+	// cycles while running headless at full host speed, so a long user
+	// session reproduces byte-identically in seconds; the final display hash
+	// is printed for verification.
+	struct ReplayHeader
+	{
+		uint32_t magic;
+		uint32_t version;
+		uint32_t seed;
+		uint32_t ips;
+		uint32_t count;
+	};
+	struct ReplayRecord
+	{
+		uint32_t cycle;
+		uint8_t key;
+		uint8_t pressed;
+		uint8_t pad[2];
+	};
+	static constexpr uint32_t REPLAY_MAGIC = 0x50523843; // "C8RP"
+	static constexpr uint32_t REPLAY_VERSION = 1;
+
+	void RecordReplay(const std::string &fileName);
+	bool PlayReplay(const std::string &fileName, uint64_t maxCycles);
+
+private:
+	const uint8_t *libraryMap;
+	size_t libraryMapSize;
+	const LibraryEntry *libraryEntries;
+	uint32_t libraryCount;
+	uint32_t libraryIndex;
+
+	TraceRecord *traceBuffer;
+	uint32_t traceIndex;
+	uint32_t traceCycle;
+	bool traceEnabled;
+	std::string traceFile;
+
+	// Applies recorded key transitions and resolves a blocked Fx0A; shared by
+	// the frame-boundary input path and replay playback.
+	void ApplyKeyTransitions(uint16_t down, uint16_t up);
+	bool DumpReplay() const;
+
+	// Virtual cycle count the run loops keep current so recorded key
+	// transitions carry an exact timestamp.
+	uint64_t replayClock;
+	bool replayRecording;
+	std::string replayFile;
+	uint32_t replaySeed;
+	std::vector<ReplayRecord> replayLog;
+
+	bool replayActive;
+	size_t replayInputIndex;
+	std::vector<ReplayRecord> replayInput;
+
+	// Quick save slot driven by the F5/F9 hotkeys in the run loop.
+	SaveStateData quickSlot;
+	bool quickSlotUsed;
 
 	static void AudioCallback(void *userdata, uint8_t *stream, int len);
 	void SawtoothWave(uint8_t *stream, int len);
+	void PublishAudioState();
+	// Sound state snapshot for the audio thread: low 16 bits are the
+	// remaining 60 Hz ticks, high 16 bits the tone frequency in Hz. The
+	// emulation thread publishes it and the callback consumes it wait-free,
+	// so the audio thread never reads the machine state directly.
+	std::atomic<uint32_t> audioState;
+	int audioFrequency;
+	int audioSampleRate;
 	double audioLevel;
 	double audioStep;
 	float audioVolume;
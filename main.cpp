@@ -16,7 +16,13 @@ You should have received a copy of the GNU General Public License
 along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 #include <iostream>
-#include <unordered_map>
+#include <fstream>
+#include <sstream>
+#include <cstring>
+#include <chrono>
+#include <vector>
+#include <thread>
+#include <atomic>
 #include <tclap/CmdLine.h>
 
 #include "chip8.h"
@@ -43,7 +49,7 @@ class IPSConstraint : public TCLAP::Constraint<uint32_t>
 public:
 	virtual std::string description() const
 	{
-		return "Cannot be lower than 60.";
+		return "Must be 0 (unlimited) or at least 60.";
 	}
 	virtual std::string shortID() const
 	{
@@ -51,7 +57,7 @@ public:
 	}
 	virtual bool check(const uint32_t &value) const
 	{
-		return value >= 60;
+		return value == 0 || value >= 60;
 	}
 };
 
@@ -98,29 +104,60 @@ public:
 	}
 };
 
+class QuirkConstraint : public TCLAP::Constraint<std::string>
+{
+public:
+	virtual std::string description() const
+	{
+		return "Must be 'original' or 'schip'.";
+	}
+	virtual std::string shortID() const
+	{
+		return "quirk profile";
+	}
+	virtual bool check(const std::string &value) const
+	{
+		return value == "original" || value == "schip";
+	}
+};
+
 struct ColorScheme
 {
+	const char *name;
 	unsigned int bg;
 	unsigned int fg;
 };
 
-static std::unordered_map<std::string, ColorScheme> schemes = {
-	{"autumn", ColorScheme{0x996600, 0xFFCC00}},
-	{"deep blue", ColorScheme{0x000080,0xFFFFFF}},
+// A flat constant table; two entries never justified building a hash map at
+// startup.
+static const ColorScheme schemes[] = {
+	{"autumn", 0x996600, 0xFFCC00},
+	{"deep blue", 0x000080, 0xFFFFFF},
 };
 
+static const ColorScheme *FindColorScheme(const std::string &name)
+{
+	for(auto &scheme: schemes)
+	{
+		if(name == scheme.name) return &scheme;
+	}
+
+	return nullptr;
+}
+
 std::string GetColorSchemeList()
 {
 	std::string list = "Available color schemes: ";
 	bool first = true;
-	for(auto it = schemes.begin(); it != schemes.end(); it++)
+	for(auto &scheme: schemes)
 	{
 		if(first)
 		{
 			first = false;
-			list += it->first;
+			list += scheme.name;
 		}else{
-			list += ", " + it->first;
+			list += ", ";
+			list += scheme.name;
 		}
 	}
 
@@ -143,39 +180,434 @@ public:
 		std::string scheme = value;
 		std::transform(scheme.begin(), scheme.end(), scheme.begin(), ::tolower);
 
-		return schemes.find(scheme) != schemes.end();
+		return FindColorScheme(scheme) != nullptr;
 	}
 };
 
+struct BatchResult
+{
+	std::string rom;
+	bool loaded;
+	uint64_t cycles;
+	uint64_t hash;
+	std::string haltReason;
+};
+
+// Run every ROM listed in listFile headless on a pool of worker threads and
+// print a per-ROM summary. Each worker reuses one Chip8 instance since the
+// class keeps all machine state in member fields.
+static void RunBatch(const std::string &listFile, unsigned int jobs, uint64_t maxCycles)
+{
+	std::vector<std::string> roms;
+
+	std::ifstream input(listFile.c_str());
+	if(!input.is_open())
+	{
+		std::cerr << "Failed to open ROM list: " << listFile << std::endl;
+		return;
+	}
+
+	std::string line;
+	while(std::getline(input, line))
+	{
+		if(line.length() > 0) roms.push_back(line);
+	}
+
+	if(roms.empty())
+	{
+		std::cerr << "ROM list is empty: " << listFile << std::endl;
+		return;
+	}
+
+	std::vector<BatchResult> results(roms.size());
+	std::atomic<size_t> next(0);
+
+	auto worker = [&]()
+	{
+		Chip8 chip8;
+		chip8.SetIPS(0); // Run each ROM as fast as possible.
+
+		while(true)
+		{
+			size_t i = next++;
+			if(i >= roms.size()) break;
+
+			BatchResult &result = results[i];
+			result.rom = roms[i];
+			result.loaded = chip8.LoadProgram(roms[i]);
+			if(!result.loaded) continue;
+
+			chip8.Run(maxCycles);
+			result.cycles = chip8.GetCycleCount();
+			result.hash = chip8.GetDisplayHash();
+			result.haltReason = chip8.GetHaltReason();
+		}
+	};
+
+	if(jobs < 1) jobs = 1;
+	if(jobs > roms.size()) jobs = roms.size();
+
+	std::vector<std::thread> threads;
+	for(unsigned int i=0; i<jobs; i++) threads.emplace_back(worker);
+	for(auto &thread: threads) thread.join();
+
+	printf("====================================================\n");
+	printf("Batch summary: %u ROMs, %u jobs.\n", (unsigned int)roms.size(), jobs);
+	for(auto &result: results)
+	{
+		if(!result.loaded)
+		{
+			printf("%-40s failed to load\n", result.rom.c_str());
+			continue;
+		}
+
+		printf("%-40s %12llu cycles  hash=%016llX  %s\n", result.rom.c_str(),
+			(unsigned long long)result.cycles, (unsigned long long)result.hash,
+			result.haltReason.length() > 0 ? result.haltReason.c_str() : "ok");
+	}
+	printf("====================================================\n");
+}
+
+struct SuiteCheck
+{
+	uint64_t cycle;
+	uint64_t hash;
+	bool record; // '?' in the manifest: print the observed hash instead of comparing.
+};
+
+struct SuiteTest
+{
+	std::string rom;
+	uint64_t budget;
+	std::vector<SuiteCheck> checks;
+};
+
+// Runs the compliance suite described by a manifest file. Each line names a
+// ROM, a cycle budget and golden display hashes at designated virtual cycles:
+//
+//   <rom> <budget> [<cycle>:<hash16>|<cycle>:? ...]   # comment
+//
+// ROM paths are resolved relative to the manifest. A '?' hash is recorded
+// rather than checked, which is how goldens get filled in initially. Because
+// the headless clock is virtual, the hashes are exact: a decoder change that
+// alters either behavior or timing shows up as a mismatch. The report is
+// tab-separated, one 'suite' line per test plus a 'suite-summary' line.
+static bool RunTestSuite(const std::string &manifest, uint32_t ips)
+{
+	std::ifstream input(manifest.c_str());
+	if(!input.is_open())
+	{
+		std::cerr << "Failed to open suite manifest: " << manifest << std::endl;
+		return false;
+	}
+
+	size_t slash = manifest.find_last_of('/');
+	std::string dir = (slash == std::string::npos) ? "" : manifest.substr(0, slash+1);
+
+	std::vector<SuiteTest> tests;
+	std::string line;
+	while(std::getline(input, line))
+	{
+		size_t comment = line.find('#');
+		if(comment != std::string::npos) line.erase(comment);
+
+		std::istringstream fields(line);
+		SuiteTest test;
+		if(!(fields >> test.rom >> test.budget)) continue;
+
+		std::string field;
+		while(fields >> field)
+		{
+			size_t colon = field.find(':');
+			if(colon == std::string::npos)
+			{
+				std::cerr << "Bad checkpoint '" << field << "' in: " << manifest << std::endl;
+				return false;
+			}
+
+			SuiteCheck check;
+			try
+			{
+				check.cycle = std::stoull(field.substr(0, colon));
+				check.record = (field.substr(colon+1) == "?");
+				check.hash = check.record ? 0 : std::stoull(field.substr(colon+1), nullptr, 16);
+			}catch(std::exception&)
+			{
+				std::cerr << "Bad checkpoint '" << field << "' in: " << manifest << std::endl;
+				return false;
+			}
+			test.checks.push_back(check);
+		}
+
+		if(test.rom[0] != '/') test.rom = dir + test.rom;
+		tests.push_back(test);
+	}
+
+	if(tests.empty())
+	{
+		std::cerr << "Suite manifest is empty: " << manifest << std::endl;
+		return false;
+	}
+
+	Chip8 chip8;
+	chip8.SetIPS(ips);
+
+	unsigned int passed = 0;
+	for(auto &test: tests)
+	{
+		if(!chip8.LoadProgram(test.rom))
+		{
+			printf("suite\t%s\tload-failed\tcycles=0\tbudget=%llu\tchecks=0/%u\n",
+				test.rom.c_str(), (unsigned long long)test.budget, (unsigned int)test.checks.size());
+			continue;
+		}
+
+		unsigned int checksPassed = 0;
+		for(auto &check: test.checks)
+		{
+			// Run() targets an absolute virtual cycle and resumes the clock, so
+			// each checkpoint is a pure observation of the one long trajectory.
+			if(check.cycle > chip8.GetCycleCount()) chip8.Run(check.cycle);
+
+			uint64_t hash = chip8.GetDisplayHash();
+			if(check.record)
+			{
+				printf("suite-check\t%s\t%llu\t?\t%016llX\trecorded\n",
+					test.rom.c_str(), (unsigned long long)check.cycle, (unsigned long long)hash);
+				checksPassed++; // Recording runs are informational, not failures.
+			}else if(hash == check.hash)
+			{
+				checksPassed++;
+			}else{
+				printf("suite-check\t%s\t%llu\t%016llX\t%016llX\tfail\n",
+					test.rom.c_str(), (unsigned long long)check.cycle,
+					(unsigned long long)check.hash, (unsigned long long)hash);
+			}
+		}
+
+		// Run out the rest of the budget so cycles-to-completion and the halt
+		// reason cover the whole test, not just the last checkpoint.
+		if(test.budget > chip8.GetCycleCount()) chip8.Run(test.budget);
+
+		bool ok = (checksPassed == test.checks.size());
+		if(ok) passed++;
+
+		printf("suite\t%s\t%s\tcycles=%llu\tbudget=%llu\tchecks=%u/%u\t%s\n",
+			test.rom.c_str(), ok ? "pass" : "fail",
+			(unsigned long long)chip8.GetCycleCount(), (unsigned long long)test.budget,
+			checksPassed, (unsigned int)test.checks.size(),
+			chip8.GetHaltReason().length() > 0 ? chip8.GetHaltReason().c_str() : "ok");
+	}
+
+	printf("suite-summary\ttests=%u\tpassed=%u\tfailed=%u\n",
+		(unsigned int)tests.size(), passed, (unsigned int)tests.size() - passed);
+
+	return passed == tests.size();
+}
+
+// Build a packed ROM library: header, index, then the concatenated images.
+static bool PackLibrary(const std::string &listFile, const std::string &outFile)
+{
+	std::ifstream input(listFile.c_str());
+	if(!input.is_open())
+	{
+		std::cerr << "Failed to open ROM list: " << listFile << std::endl;
+		return false;
+	}
+
+	std::vector<Chip8::LibraryEntry> entries;
+	std::vector<std::string> blobs;
+
+	std::string line;
+	while(std::getline(input, line))
+	{
+		if(line.length() == 0) continue;
+
+		std::ifstream rom(line.c_str(), std::ios::in|std::ios::binary);
+		if(!rom.is_open())
+		{
+			std::cerr << "Failed to open ROM: " << line << std::endl;
+			return false;
+		}
+
+		std::string data((std::istreambuf_iterator<char>(rom)), std::istreambuf_iterator<char>());
+		if(data.length() == 0 || data.length() > 0x1000-0x200) // Program space is 3584 bytes.
+		{
+			std::cerr << "ROM is empty or too large: " << line << std::endl;
+			return false;
+		}
+
+		Chip8::LibraryEntry entry;
+		std::memset(&entry, 0, sizeof(entry));
+
+		size_t slash = line.find_last_of('/');
+		std::string name = (slash == std::string::npos) ? line : line.substr(slash+1);
+		std::strncpy(entry.name, name.c_str(), sizeof(entry.name)-1);
+		entry.size = data.length();
+
+		entries.push_back(entry);
+		blobs.push_back(data);
+	}
+
+	if(entries.empty())
+	{
+		std::cerr << "ROM list is empty: " << listFile << std::endl;
+		return false;
+	}
+
+	// Lay the images out right after the index.
+	uint32_t offset = sizeof(Chip8::LibraryHeader) + entries.size() * sizeof(Chip8::LibraryEntry);
+	for(size_t i=0; i<entries.size(); i++)
+	{
+		entries[i].offset = offset;
+		offset += entries[i].size;
+	}
+
+	std::ofstream output(outFile.c_str(), std::ios::out|std::ios::binary|std::ios::trunc);
+	if(!output.is_open())
+	{
+		std::cerr << "Failed to open output file: " << outFile << std::endl;
+		return false;
+	}
+
+	Chip8::LibraryHeader header;
+	header.magic = Chip8::LIBRARY_MAGIC;
+	header.version = Chip8::LIBRARY_VERSION;
+	header.count = entries.size();
+
+	output.write((const char *)&header, sizeof(header));
+	output.write((const char *)entries.data(), entries.size() * sizeof(Chip8::LibraryEntry));
+	for(auto &blob: blobs) output.write(blob.data(), blob.length());
+
+	std::cout << "Packed " << entries.size() << " ROMs into " << outFile << std::endl;
+
+	return true;
+}
+
+// Pretty-print a binary trace dump produced by Chip8::DumpTrace().
+static bool PrintTrace(const std::string &fileName)
+{
+	std::ifstream input(fileName.c_str(), std::ios::in|std::ios::binary);
+	if(!input.is_open())
+	{
+		std::cerr << "Failed to open trace: " << fileName << std::endl;
+		return false;
+	}
+
+	Chip8::TraceHeader header;
+	input.read((char *)&header, sizeof(header));
+	if(input.gcount() != sizeof(header) || header.magic != Chip8::TRACE_MAGIC || header.version != Chip8::TRACE_VERSION)
+	{
+		std::cerr << "Unrecognized trace format: " << fileName << std::endl;
+		return false;
+	}
+
+	printf("%u trace records:\n", header.count);
+	printf("     cycle  addr    opcode\n");
+
+	Chip8::TraceRecord record;
+	for(uint32_t i=0; i<header.count; i++)
+	{
+		input.read((char *)&record, sizeof(record));
+		if(input.gcount() != sizeof(record)) break;
+
+		printf("%10u  0x%03X  0x%04X\n", record.cycle, record.pc, record.opCode);
+	}
+
+	return true;
+}
+
 int main(int argc, char** argv)
 {
+	auto launch = std::chrono::high_resolution_clock::now();
+
 	try{
 		TCLAP::CmdLine cmd("A CHIP-8 interpreter written in C++.", ' ', "0.1");
 		
-		TCLAP::UnlabeledValueArg<std::string> filePath("run", "Provide a relative or absolute path.", true, "", "Path to CHIP-8 program", cmd, false);
+		TCLAP::UnlabeledValueArg<std::string> filePath("run", "Provide a relative or absolute path.", false, "", "Path to CHIP-8 program", cmd, false);
+		TCLAP::ValueArg<std::string> batch("", "batch", "Run every ROM listed in the given file (one path per line) headless and print a summary.", false, "", "rom list", cmd);
+		TCLAP::ValueArg<std::string> testSuite("", "test-suite", "Run the compliance suite described by the given manifest headless and report golden hash checks per ROM. Honors -i.", false, "", "suite manifest", cmd);
+		TCLAP::ValueArg<unsigned int> jobs("j", "jobs", "Number of worker threads for --batch. Default: 1", false, 1, "threads", cmd);
+		TCLAP::ValueArg<std::string> library("", "library", "Load programs from a packed ROM library. F10 rotates to the next program.", false, "", "library file", cmd);
+		TCLAP::ValueArg<unsigned int> libraryIndex("", "library-index", "Program to start with from the library. Default: 0", false, 0, "index", cmd);
+		TCLAP::ValueArg<std::string> packLibrary("", "pack-library", "Build a packed ROM library at the given path from the ROM list supplied as the program argument.", false, "", "output file", cmd);
+		TCLAP::ValueArg<std::string> trace("", "trace", "Record executed instructions into a ring buffer, dumped to the given file on halt or with F4.", false, "", "trace file", cmd);
+		TCLAP::ValueArg<std::string> dumpTrace("", "dump-trace", "Pretty-print a previously recorded trace file and exit.", false, "", "trace file", cmd);
+		TCLAP::ValueArg<std::string> recordReplay("", "record-replay", "Record the RNG seed and key timings of this session to the given file.", false, "", "replay file", cmd);
+		TCLAP::ValueArg<std::string> replay("", "replay", "Replay a recorded session headless at full speed and print the final display hash.", false, "", "replay file", cmd);
 		TCLAP::SwitchArg listAudioDevices("l", "list-audio-devices", "List the available audio devices.", cmd, false);
 		TCLAP::ValueArg<std::string> audioDevice("a", "audio-device", "Provide the name of the audio device to use from the output of -l.", false, "", "device name", cmd);
 		PixelConstraint pc;
 		TCLAP::ValueArg<unsigned int> pixelScale("p", "pixel-scale", "Amount to scale each pixel in the 64x32 display. Default: 16", false, 16, &pc, cmd);
 		IPSConstraint ic;
-		TCLAP::ValueArg<uint32_t> ips("i", "ips", "Number of instructions to execute per second. Default: 600", false, 600, &ic, cmd);
+		TCLAP::ValueArg<uint32_t> ips("i", "ips", "Number of instructions to execute per second, or 0 to run as fast as possible. Default: 600", false, 600, &ic, cmd);
 		VolumeConstraint vc;
 		TCLAP::ValueArg<float> volume("v", "volume", "Volume level from 0 to 1. Default: 0.1", false, 0.1f, &vc, cmd);
 		TCLAP::SwitchArg debugMode("d", "debug", "Enable debuging mode.", cmd, false);
+		TCLAP::SwitchArg vsync("", "vsync", "Let the GPU pace frame presents (SDL_RENDERER_PRESENTVSYNC).", cmd, false);
+		TCLAP::SwitchArg headless("", "headless", "Run the CPU core without a window or audio. Useful for benchmarking and automated testing.", cmd, false);
+		TCLAP::SwitchArg server("", "server", "Keep the window, renderer and audio device alive across halts and accept commands on stdin: load <path>, load-index <n>, reset, colors <bg> <fg>, pause, resume, stats, quit.", cmd, false);
+		TCLAP::SwitchArg timeStartup("", "time-startup", "Report the time from launch to the first executed instruction.", cmd, false);
+		TCLAP::ValueArg<unsigned long long> maxCycles("m", "max-cycles", "Maximum number of instructions to execute in headless mode. Default: 100000000", false, 100000000ULL, "cycles", cmd);
+		TCLAP::ValueArg<unsigned long long> checkpoint("", "checkpoint", "Print the cycle count and display hash every N cycles in headless mode.", false, 0, "cycles", cmd);
+		TCLAP::ValueArg<std::string> checkpointFile("", "checkpoint-file", "Write --checkpoint lines to the given file instead of stdout.", false, "", "output file", cmd);
 		HexStringConstraint hc;
 		TCLAP::ValueArg<std::string> background("b", "background", "Background color in RRGGBB hexadecimal format.", false, "", &hc, cmd);
 		TCLAP::ValueArg<std::string> foreground("f", "foreground", "Foreground color in RRGGBB hexadecimal format.", false, "", &hc, cmd);
+		QuirkConstraint qc;
+		TCLAP::ValueArg<std::string> quirks("q", "quirks", "Quirk profile for shift and load/store instructions. Default: original", false, "original", &qc, cmd);
 		ColorSchemeConstraint csc;
 		TCLAP::ValueArg<std::string> colorScheme("c", "color-scheme", GetColorSchemeList(), false, "", &csc, cmd);
 
 		cmd.parse(argc, argv);
 
+		if(dumpTrace.isSet())
+		{
+			return PrintTrace(dumpTrace.getValue()) ? 0 : 1;
+		}
+
+		if(batch.isSet())
+		{
+			RunBatch(batch.getValue(), jobs.getValue(), maxCycles.getValue());
+			return 0;
+		}
+
+		if(testSuite.isSet())
+		{
+			return RunTestSuite(testSuite.getValue(), ips.getValue()) ? 0 : 1;
+		}
+
+		if(packLibrary.isSet())
+		{
+			if(!filePath.isSet())
+			{
+				std::cerr << "Error: --pack-library needs a ROM list as the program argument." << std::endl;
+				return 1;
+			}
+
+			return PackLibrary(filePath.getValue(), packLibrary.getValue()) ? 0 : 1;
+		}
+
+		if(!filePath.isSet() && !library.isSet())
+		{
+			std::cerr << "Error: No CHIP-8 program given. Provide a path, --library or --batch." << std::endl;
+			return 1;
+		}
+
 		Chip8 chip8;
 
 		chip8.SetIPS(ips.getValue());
 		chip8.SetVolume(volume.getValue());
 		chip8.EnableDebug(debugMode.getValue());
 		chip8.SetPixelScale(pixelScale.getValue());
+		chip8.SetVSync(vsync.getValue());
+		if(timeStartup.getValue()) chip8.TimeStartup(launch);
+
+		if(trace.isSet()) chip8.EnableTrace(trace.getValue());
+		if(recordReplay.isSet()) chip8.RecordReplay(recordReplay.getValue());
+		if(checkpoint.isSet()) chip8.SetCheckpointInterval(checkpoint.getValue());
+		if(checkpointFile.isSet() && !chip8.SetCheckpointFile(checkpointFile.getValue())) return 1;
+		if(quirks.getValue() == "schip") chip8.SetQuirkMode(Chip8::Quirk_SCHIP);
 		
 		if(audioDevice.isSet()) chip8.SetPreferredAudioDevice(audioDevice.getValue());
 
@@ -184,22 +616,55 @@ int main(int argc, char** argv)
 
 		if(colorScheme.isSet())
 		{
-			std::string scheme = colorScheme.getValue();
-			std::transform(scheme.begin(), scheme.end(), scheme.begin(), ::tolower);
+			std::string name = colorScheme.getValue();
+			std::transform(name.begin(), name.end(), name.begin(), ::tolower);
 
-			auto key = schemes.find(scheme);
-			if(key != schemes.end())
+			const ColorScheme *scheme = FindColorScheme(name);
+			if(scheme != nullptr)
 			{
-				chip8.SetBackgroundColor(key->second.bg);
-				chip8.SetForegroundColor(key->second.fg);
+				chip8.SetBackgroundColor(scheme->bg);
+				chip8.SetForegroundColor(scheme->fg);
 			}
 		}
 
 		if(listAudioDevices.getValue()) chip8.ShowAudioDevices();
 
-		if(chip8.LoadProgram(filePath.getValue()))
+		bool loaded;
+		if(library.isSet())
+		{
+			loaded = chip8.LoadLibrary(library.getValue()) && chip8.LoadProgramFromLibrary(libraryIndex.getValue());
+		}else{
+			loaded = chip8.LoadProgram(filePath.getValue());
+		}
+
+		if(loaded)
 		{
-			chip8.Run();
+			if(replay.isSet())
+			{
+				return chip8.PlayReplay(replay.getValue(), maxCycles.getValue()) ? 0 : 1;
+			}
+
+			if(server.getValue())
+			{
+				chip8.EnableServer();
+
+				// Feed stdin lines to the command queue. Detached: getline
+				// cannot be interrupted, and the process exits right after
+				// Run() returns anyway.
+				std::thread reader([&chip8]()
+				{
+					std::string line;
+					while(std::getline(std::cin, line)) chip8.SubmitCommand(line);
+				});
+				reader.detach();
+			}
+
+			if(headless.getValue())
+			{
+				chip8.Run(maxCycles.getValue());
+			}else{
+				chip8.Run();
+			}
 		}
 	}catch(TCLAP::ArgException &e)
 	{